@@ -10,6 +10,7 @@
 #include <cstdarg>
 #include <fstream>
 #include <cstdio>
+#include <thread>
 
 // bringing stand libraray objects in scope
 using std::string;
@@ -53,6 +54,24 @@ struct range {
     iterator end() { return iterator(max); }
 };
 
+// number of threads parallel_for uses for count items, each thread getting at least grain items
+inline int parallel_threads(int count, int grain) {
+    auto threads_num = (int)std::thread::hardware_concurrency();
+    if(threads_num > count / (grain > 0 ? grain : 1)) threads_num = count / (grain > 0 ? grain : 1);
+    return (threads_num > 1) ? threads_num : 1;
+}
+
+// runs body(start,end) over contiguous chunks of [0,count) on the hardware threads,
+// giving each thread at least grain items (serially for small counts)
+template<typename F>
+inline void parallel_for(int count, int grain, const F& body) {
+    auto threads_num = parallel_threads(count, grain);
+    if(threads_num <= 1) { if(count > 0) body(0, count); return; }
+    auto threads = vector<std::thread>();
+    for(auto t : range(threads_num)) threads.push_back(std::thread(body, (int)((long long)count*t/threads_num), (int)((long long)count*(t+1)/threads_num)));
+    for(auto& thread : threads) thread.join();
+}
+
 // load a text file into a buffer
 inline string load_text_file(const char* filename) {
     auto text = string("");
@@ -0,0 +1,141 @@
+#include "compress.h"
+
+#include <cstring>
+
+unsigned short float_to_half(float f) {
+    unsigned int x;
+    memcpy(&x, &f, sizeof(x));
+    auto sign = (x >> 16) & 0x8000;
+    auto exp = (int)((x >> 23) & 0xff) - 127 + 15;
+    auto mant = x & 0x7fffff;
+    // infinity and nan
+    if(((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | ((mant) ? 0x200 : 0);
+    // overflow to infinity
+    if(exp >= 31) return sign | 0x7c00;
+    // denormals, or underflow to zero
+    if(exp <= 0) {
+        if(exp < -10) return sign;
+        mant |= 0x800000;
+        auto shift = 14 - exp;
+        auto h = mant >> shift;
+        if((mant >> (shift-1)) & 1) h++;
+        return sign | h;
+    }
+    // a rounding carry moves into the exponent, which is still the nearest value
+    auto h = sign | (exp << 10) | (mant >> 13);
+    if(mant & 0x1000) h++;
+    return h;
+}
+
+float half_to_float(unsigned short h) {
+    auto sign = (h & 0x8000) ? -1.0f : 1.0f;
+    auto exp = (h >> 10) & 0x1f;
+    auto mant = h & 0x3ff;
+    if(exp == 0) return sign * ldexp((float)mant, -24);
+    if(exp == 31) return (mant) ? NAN : sign * HUGE_VALF;
+    return sign * ldexp((float)(mant | 0x400), exp-25);
+}
+
+vec2f octahedral_encode(const vec3f& n) {
+    auto l1 = abs(n.x)+abs(n.y)+abs(n.z);
+    // zero vectors (missing normals) encode as (0,0,1)
+    if(l1 == 0) return vec2f(0,0);
+    auto p = n / l1;
+    // fold the lower hemisphere over the diagonals
+    if(p.z < 0) return vec2f((1-abs(p.y)) * ((p.x >= 0) ? 1 : -1), (1-abs(p.x)) * ((p.y >= 0) ? 1 : -1));
+    return vec2f(p.x, p.y);
+}
+
+vec3f octahedral_decode(const vec2f& e) {
+    auto n = vec3f(e.x, e.y, 1-abs(e.x)-abs(e.y));
+    if(n.z < 0) n = vec3f((1-abs(e.y)) * ((e.x >= 0) ? 1 : -1), (1-abs(e.x)) * ((e.y >= 0) ? 1 : -1), n.z);
+    return normalize(n);
+}
+
+// quantize a value in [0,1] to 16 bits
+unsigned short _quantize(float v) {
+    return (unsigned short)(clamp(v, 0.0f, 1.0f) * 65535 + 0.5f);
+}
+
+CompressedVertices compress_vertices(Mesh* mesh) {
+    auto compressed = CompressedVertices();
+    auto bbox = range3f();
+    for(auto& p : mesh->pos) bbox = runion(bbox, p);
+    if(not mesh->pos.empty()) {
+        compressed.pos_offset = bbox.min;
+        compressed.pos_scale = size(bbox);
+    }
+    auto& s = compressed.pos_scale;
+    for(auto& p : mesh->pos) {
+        auto q = p - compressed.pos_offset;
+        compressed.pos.push_back(_quantize((s.x > 0) ? q.x / s.x : 0));
+        compressed.pos.push_back(_quantize((s.y > 0) ? q.y / s.y : 0));
+        compressed.pos.push_back(_quantize((s.z > 0) ? q.z / s.z : 0));
+    }
+    for(auto& n : mesh->norm) {
+        auto e = octahedral_encode(n);
+        compressed.norm.push_back(_quantize(e.x*0.5f+0.5f));
+        compressed.norm.push_back(_quantize(e.y*0.5f+0.5f));
+    }
+    for(auto& t : mesh->texcoord) {
+        compressed.texcoord.push_back(float_to_half(t.x));
+        compressed.texcoord.push_back(float_to_half(t.y));
+    }
+    return compressed;
+}
+
+void decompress_vertices(const CompressedVertices& compressed, vector<vec3f>& pos, vector<vec3f>& norm, vector<vec2f>& texcoord) {
+    pos.clear();
+    norm.clear();
+    texcoord.clear();
+    for(auto i = 0; i < (int)compressed.pos.size(); i += 3) {
+        auto q = vec3f(compressed.pos[i], compressed.pos[i+1], compressed.pos[i+2]) / 65535;
+        pos.push_back(compressed.pos_offset + compressed.pos_scale * q);
+    }
+    for(auto i = 0; i < (int)compressed.norm.size(); i += 2) {
+        auto e = vec2f(compressed.norm[i], compressed.norm[i+1]) / 65535;
+        norm.push_back(octahedral_decode(e*2-one2f));
+    }
+    for(auto i = 0; i < (int)compressed.texcoord.size(); i += 2) {
+        texcoord.push_back(vec2f(half_to_float(compressed.texcoord[i]), half_to_float(compressed.texcoord[i+1])));
+    }
+}
+
+CompressionError compression_error(Mesh* mesh, const CompressedVertices& compressed) {
+    auto error = CompressionError();
+    auto pos = vector<vec3f>(), norm = vector<vec3f>();
+    auto texcoord = vector<vec2f>();
+    decompress_vertices(compressed, pos, norm, texcoord);
+    for(auto i : range(pos.size())) error.pos = max(error.pos, dist(pos[i], mesh->pos[i]));
+    for(auto i : range(norm.size())) {
+        // the angle from its sine and cosine keeps small errors accurate
+        auto n = normalize(mesh->norm[i]);
+        error.norm = max(error.norm, atan2(length(cross(norm[i], n)), dot(norm[i], n)) * 180 / pif);
+    }
+    for(auto i : range(texcoord.size())) {
+        error.texcoord = max(error.texcoord, max(abs(texcoord[i].x-mesh->texcoord[i].x), abs(texcoord[i].y-mesh->texcoord[i].y)));
+    }
+    error.bytes = mesh->pos.size()*sizeof(vec3f) + mesh->norm.size()*sizeof(vec3f) + mesh->texcoord.size()*sizeof(vec2f);
+    error.compressed_bytes = (compressed.pos.size() + compressed.norm.size() + compressed.texcoord.size()) * sizeof(unsigned short);
+    return error;
+}
+
+void print_compression_report(Scene* scene) {
+    auto count = 0;
+    auto bytes = 0, compressed_bytes = 0;
+    for(auto mesh : get_display_meshes(scene)) {
+        auto meshes = vector<Mesh*>(1,mesh);
+        if(mesh->lod) for(auto& level : mesh->lod->levels) meshes.push_back(level.mesh);
+        for(auto i : range(meshes.size())) {
+            auto m = meshes[i];
+            if(m->pos.empty()) continue;
+            auto error = compression_error(m, compress_vertices(m));
+            message("mesh %d lod %d: %d vertices, %d -> %d bytes, position error %g, normal error %.4f deg, texcoord error %g\n",
+                    count, i, (int)m->pos.size(), error.bytes, error.compressed_bytes, error.pos, error.norm, error.texcoord);
+            bytes += error.bytes;
+            compressed_bytes += error.compressed_bytes;
+        }
+        count++;
+    }
+    message("vertex data: %d -> %d bytes\n", bytes, compressed_bytes);
+}
@@ -0,0 +1,50 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include "scene.h"
+
+// vertex data compressed for upload: positions quantized to 16 bits in the mesh bounds,
+// normals octahedral encoded in 2x16 bits and texture coordinates as half floats
+// (14 bytes per vertex instead of 32)
+struct CompressedVertices {
+    vec3f                   pos_offset = zero3f;    // position of the quantized zero
+    vec3f                   pos_scale = one3f;      // size of the quantized range
+    vector<unsigned short>  pos;                    // quantized positions (3 per vertex, unsigned normalized)
+    vector<unsigned short>  norm;                   // octahedral normals (2 per vertex, unsigned normalized)
+    vector<unsigned short>  texcoord;               // half float texture coordinates (2 per vertex)
+};
+
+// maximum errors of a compressed mesh
+struct CompressionError {
+    float   pos = 0;            // position error (mesh coordinates)
+    float   norm = 0;           // normal error (degrees)
+    float   texcoord = 0;       // texture coordinate error
+    int     bytes = 0;          // uncompressed vertex data size
+    int     compressed_bytes = 0;   // compressed vertex data size
+};
+
+// convert a float to a half float, rounding to the nearest
+unsigned short float_to_half(float f);
+
+// convert a half float to a float
+float half_to_float(unsigned short h);
+
+// encode a unit vector in the [-1,1] square by projecting it on an octahedron (zero vectors as (0,0,1))
+vec2f octahedral_encode(const vec3f& n);
+
+// decode an octahedral encoded unit vector
+vec3f octahedral_decode(const vec2f& e);
+
+// compress mesh vertex data
+CompressedVertices compress_vertices(Mesh* mesh);
+
+// decode compressed vertex data as the vertex shader does (reference decoder)
+void decompress_vertices(const CompressedVertices& compressed, vector<vec3f>& pos, vector<vec3f>& norm, vector<vec2f>& texcoord);
+
+// measure the errors introduced by compression
+CompressionError compression_error(Mesh* mesh, const CompressedVertices& compressed);
+
+// print compression errors and sizes for the display meshes and their levels of detail
+void print_compression_report(Scene* scene);
+
+#endif
@@ -0,0 +1,406 @@
+#include "culling.h"
+#include "simplify.h"
+
+#include <algorithm>
+
+// spread the lower 10 bits of x so that there are two zero bits between each
+unsigned int _morton_spread(unsigned int x) {
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+// 30-bit Morton code of a point quantized in a bounding box
+unsigned int _morton_code(const vec3f& p, const range3f& bbox) {
+    auto s = size(bbox);
+    auto q = vec3f(s.x > 0 ? (p.x-bbox.min.x)/s.x : 0, s.y > 0 ? (p.y-bbox.min.y)/s.y : 0, s.z > 0 ? (p.z-bbox.min.z)/s.z : 0);
+    auto x = (unsigned int)clamp(q.x*1023, 0.0f, 1023.0f);
+    auto y = (unsigned int)clamp(q.y*1023, 0.0f, 1023.0f);
+    auto z = (unsigned int)clamp(q.z*1023, 0.0f, 1023.0f);
+    return (_morton_spread(x) << 2) | (_morton_spread(y) << 1) | _morton_spread(z);
+}
+
+// dominant axis of a face normal, as one of six directions (+x,-x,+y,-y,+z,-z)
+int _normal_bin(const vec3f& n) {
+    auto a = vec3f(abs(n.x),abs(n.y),abs(n.z));
+    if(a.x >= a.y and a.x >= a.z) return n.x >= 0 ? 0 : 1;
+    if(a.y >= a.z) return n.y >= 0 ? 2 : 3;
+    return n.z >= 0 ? 4 : 5;
+}
+
+// sort faces by the dominant direction of their normal, then by the Morton code of their centroid,
+// so that clusters are both spatially coherent and have narrow normal cones
+template<typename T>
+void _morton_sort(vector<T>& faces, int n, const vector<vec3f>& pos, const range3f& bbox) {
+    auto keyed = vector<pair<unsigned long long,int>>(faces.size());
+    for(auto i : range(faces.size())) {
+        auto& f = faces[i];
+        auto c = zero3f;
+        for(auto k : range(n)) c += pos[f[k]];
+        auto fn = cross(pos[f[1]]-pos[f[0]], pos[f[2]]-pos[f[0]]);
+        keyed[i] = { ((unsigned long long)_normal_bin(fn) << 30) | _morton_code(c/n, bbox), i };
+    }
+    std::stable_sort(keyed.begin(), keyed.end(),
+                     [](const pair<unsigned long long,int>& a, const pair<unsigned long long,int>& b){ return a.first < b.first; });
+    auto sorted = vector<T>(faces.size());
+    for(auto i : range(faces.size())) sorted[i] = faces[keyed[i].second];
+    faces = sorted;
+}
+
+// compute the cluster bounds and normal cone from its faces
+template<typename T>
+void _make_cluster(MeshCulling::Cluster& cluster, const vector<T>& faces, int start, int count, int n, const vector<vec3f>& pos) {
+    // face normals, with quads split along the x-z diagonal
+    auto normals = vector<vec3f>();
+    for(auto i : range(start, start+count)) {
+        auto& f = faces[i];
+        for(auto k : range(n)) cluster.bbox = runion(cluster.bbox, pos[f[k]]);
+        auto fn = cross(pos[f[1]]-pos[f[0]], pos[f[2]]-pos[f[0]]);
+        if(n == 4) fn += cross(pos[f[2]]-pos[f[0]], pos[f[3]]-pos[f[0]]);
+        if(lengthSqr(fn) > 0) normals.push_back(normalize(fn));
+    }
+    // average direction and the widest deviation from it
+    auto axis = zero3f;
+    for(auto& fn : normals) axis += fn;
+    cluster.cone_cutoff = 1;
+    if(normals.empty() or lengthSqr(axis) == 0) return;
+    cluster.cone_axis = normalize(axis);
+    auto mindp = 1.0f;
+    for(auto& fn : normals) mindp = min(mindp, dot(fn, cluster.cone_axis));
+    // cones wider than ~85 degrees are not worth testing
+    if(mindp <= 0.1f) return;
+    cluster.cone_cutoff = sqrt(1-mindp*mindp);
+}
+
+void compute_bounds(Mesh* mesh) {
+    if(not mesh->culling) mesh->culling = new MeshCulling();
+    auto culling = mesh->culling;
+    // mesh bounds over all vertices, so that lines, points and hair are included
+    culling->bbox = bounds(mesh->pos);
+    if(mesh->hair) culling->bbox = runion(culling->bbox, bounds(mesh->hair->pos));
+    // order faces along a Morton curve so that consecutive faces are close in space
+    if((int)mesh->triangle.size() > culling_cluster_size) _morton_sort(mesh->triangle, 3, mesh->pos, culling->bbox);
+    if((int)mesh->quad.size() > culling_cluster_size) _morton_sort(mesh->quad, 4, mesh->pos, culling->bbox);
+    // split faces into clusters of consecutive faces
+    culling->clusters.clear();
+    for(auto start = 0; start < (int)mesh->triangle.size(); start += culling_cluster_size) {
+        auto cluster = MeshCulling::Cluster();
+        cluster.triangle_start = start;
+        cluster.triangle_count = min((int)mesh->triangle.size()-start, culling_cluster_size);
+        _make_cluster(cluster, mesh->triangle, cluster.triangle_start, cluster.triangle_count, 3, mesh->pos);
+        culling->clusters.push_back(cluster);
+    }
+    for(auto start = 0; start < (int)mesh->quad.size(); start += culling_cluster_size) {
+        auto cluster = MeshCulling::Cluster();
+        cluster.quad_start = start;
+        cluster.quad_count = min((int)mesh->quad.size()-start, culling_cluster_size);
+        _make_cluster(cluster, mesh->quad, cluster.quad_start, cluster.quad_count, 4, mesh->pos);
+        culling->clusters.push_back(cluster);
+    }
+}
+
+void compute_bounds(Scene* scene) {
+    for(auto mesh : get_display_meshes(scene)) {
+        compute_bounds(mesh);
+        if(mesh->lod) for(auto& level : mesh->lod->levels) compute_bounds(level.mesh);
+    }
+}
+
+Frustum make_frustum(Camera* camera, float far) {
+    // planes in camera coordinates: the camera looks down -z and the
+    // image plane is at distance dist with size (width,height)
+    auto hw = camera->width/2, hh = camera->height/2, d = camera->dist;
+    vec4f planes[6] = {
+        { d, 0, -hw, 0 },   // left
+        { -d, 0, -hw, 0 },  // right
+        { 0, d, -hh, 0 },   // bottom
+        { 0, -d, -hh, 0 },  // top
+        { 0, 0, -1, -d },   // near
+        { 0, 0, 1, far },   // far
+    };
+    // move the planes to world coordinates
+    auto frustum = Frustum();
+    for(auto i : range(6)) {
+        auto n = transform_normal(camera->frame, normalize(vec3f(planes[i].x,planes[i].y,planes[i].z)));
+        auto w = planes[i].w / length(vec3f(planes[i].x,planes[i].y,planes[i].z));
+        frustum.planes[i] = vec4f(n.x, n.y, n.z, w - dot(n, camera->frame.o));
+    }
+    return frustum;
+}
+
+range3f transform_bbox(const frame3f& frame, const range3f& bbox) {
+    if(not isvalid(bbox)) return bbox;
+    // transform the center and grow the half size by the absolute axes
+    auto c = transform_point(frame, center(bbox));
+    auto e = size(bbox)/2;
+    auto ax = vec3f(abs(frame.x.x),abs(frame.x.y),abs(frame.x.z));
+    auto ay = vec3f(abs(frame.y.x),abs(frame.y.y),abs(frame.y.z));
+    auto az = vec3f(abs(frame.z.x),abs(frame.z.y),abs(frame.z.z));
+    auto te = ax*e.x + ay*e.y + az*e.z;
+    return range3f(c-te, c+te);
+}
+
+bool frustum_overlap(const Frustum& frustum, const range3f& bbox) {
+    if(not isvalid(bbox)) return false;
+    auto c = center(bbox), e = size(bbox)/2;
+    for(auto& plane : frustum.planes) {
+        // distance of the box center and projected half size on the plane normal
+        auto d = plane.x*c.x + plane.y*c.y + plane.z*c.z + plane.w;
+        auto r = abs(plane.x)*e.x + abs(plane.y)*e.y + abs(plane.z)*e.z;
+        if(d + r < 0) return false;
+    }
+    return true;
+}
+
+bool cluster_backfacing(const MeshCulling::Cluster& cluster, const vec3f& eye) {
+    if(cluster.cone_cutoff >= 1 or not isvalid(cluster.bbox)) return false;
+    // conservative cone test against the cluster bounding sphere
+    auto c = center(cluster.bbox), d = c - eye;
+    auto radius = length(size(cluster.bbox))/2;
+    return dot(d, cluster.cone_axis) >= cluster.cone_cutoff * length(d) + radius;
+}
+
+void clear_occlusion(OcclusionBuffer* occlusion, Camera* camera) {
+    occlusion->camera = *camera;
+    occlusion->levels.resize(1);
+    occlusion->levels[0].assign(occlusion->width*occlusion->height, HUGE_VALF);
+}
+
+// project a world point in the occlusion buffer, returning pixel coordinates and view distance
+// returns false if the point is in front of the image plane
+bool _occlusion_project(OcclusionBuffer* occlusion, const vec3f& p, vec3f& sp) {
+    auto& camera = occlusion->camera;
+    auto cp = transform_point_inverse(camera.frame, p);
+    if(-cp.z < camera.dist) return false;
+    auto x = cp.x * camera.dist / (-cp.z) / camera.width + 0.5f;
+    auto y = cp.y * camera.dist / (-cp.z) / camera.height + 0.5f;
+    sp = vec3f(x*occlusion->width, y*occlusion->height, -cp.z);
+    return true;
+}
+
+// rasterize a triangle at pixel centers, writing the farthest view distance of its plane over the pixel
+// (so that slanted occluders never look nearer than they are), and keeping the nearest per pixel
+void _occlusion_triangle(OcclusionBuffer* occlusion, const vec3f& a, const vec3f& b, const vec3f& c) {
+    auto area = (b.x-a.x)*(c.y-a.y) - (b.y-a.y)*(c.x-a.x);
+    if(area == 0) return;
+    auto& depth = occlusion->levels[0];
+    auto i0 = max(0, (int)floor(min(a.x,min(b.x,c.x)))), i1 = min(occlusion->width-1, (int)ceil(max(a.x,max(b.x,c.x))));
+    auto j0 = max(0, (int)floor(min(a.y,min(b.y,c.y)))), j1 = min(occlusion->height-1, (int)ceil(max(a.y,max(b.y,c.y))));
+    // view distance is not linear in screen space, but its reciprocal is, so that over a pixel the
+    // farthest distance of the plane is at one of its corners
+    auto ia = 1/a.z, ib = 1/b.z, ic = 1/c.z;
+    auto inverse_depth = [&](float px, float py, float& wa, float& wb, float& wc) {
+        wa = ((b.x-px)*(c.y-py) - (b.y-py)*(c.x-px)) / area;
+        wb = ((c.x-px)*(a.y-py) - (c.y-py)*(a.x-px)) / area;
+        wc = 1 - wa - wb;
+        return wa*ia + wb*ib + wc*ic;
+    };
+    auto wa = 0.0f, wb = 0.0f, wc = 0.0f;
+    for(auto j = j0; j <= j1; j++) {
+        for(auto i = i0; i <= i1; i++) {
+            // coverage at the pixel center
+            inverse_depth(i+0.5f, j+0.5f, wa, wb, wc);
+            if(wa < 0 or wb < 0 or wc < 0) continue;
+            auto id = HUGE_VALF;
+            for(auto dj : range(2)) for(auto di : range(2)) id = min(id, inverse_depth(i+di, j+dj, wa, wb, wc));
+            // the plane may pass behind the camera within the pixel
+            if(id <= 0) continue;
+            auto& pd = depth[j*occlusion->width+i];
+            pd = min(pd, 1 / id);
+        }
+    }
+}
+
+int rasterize_occluder(OcclusionBuffer* occlusion, Mesh* mesh, const MeshCulling::Cluster& cluster) {
+    auto count = 0;
+    vec3f sp[4];
+    auto project = [&](int vid, int k){ return _occlusion_project(occlusion, transform_point(mesh->frame, mesh->pos[vid]), sp[k]); };
+    // faces crossing the image plane are skipped, which only makes the occluders smaller
+    for(auto i : range(cluster.triangle_start, cluster.triangle_start+cluster.triangle_count)) {
+        auto& f = mesh->triangle[i];
+        if(not project(f.x,0) or not project(f.y,1) or not project(f.z,2)) continue;
+        _occlusion_triangle(occlusion, sp[0], sp[1], sp[2]);
+        count += 1;
+    }
+    for(auto i : range(cluster.quad_start, cluster.quad_start+cluster.quad_count)) {
+        auto& f = mesh->quad[i];
+        if(not project(f.x,0) or not project(f.y,1) or not project(f.z,2) or not project(f.w,3)) continue;
+        _occlusion_triangle(occlusion, sp[0], sp[1], sp[2]);
+        _occlusion_triangle(occlusion, sp[0], sp[2], sp[3]);
+        count += 2;
+    }
+    return count;
+}
+
+void build_occlusion_hierarchy(OcclusionBuffer* occlusion) {
+    occlusion->levels.resize(1);
+    auto w = occlusion->width, h = occlusion->height;
+    while(w > 1 or h > 1) {
+        auto nw = max(1,(w+1)/2), nh = max(1,(h+1)/2);
+        auto& prev = occlusion->levels.back();
+        auto next = vector<float>(nw*nh);
+        for(auto j : range(nh)) {
+            for(auto i : range(nw)) {
+                // farthest depth of the (up to) 2x2 block
+                auto d = 0.0f;
+                for(auto dj : range(2)) for(auto di : range(2)) {
+                    auto pi = min(2*i+di,w-1), pj = min(2*j+dj,h-1);
+                    d = max(d, prev[pj*w+pi]);
+                }
+                next[j*nw+i] = d;
+            }
+        }
+        occlusion->levels.push_back(next);
+        w = nw; h = nh;
+    }
+}
+
+bool occlusion_visible(OcclusionBuffer* occlusion, const range3f& bbox) {
+    if(occlusion->levels.empty()) return true;
+    // screen rectangle and nearest distance of the box
+    auto smin = vec3f(HUGE_VALF,HUGE_VALF,HUGE_VALF), smax = -smin;
+    for(auto& p : corners(bbox)) {
+        auto sp = zero3f;
+        if(not _occlusion_project(occlusion, p, sp)) return true;
+        smin = min(smin, sp); smax = max(smax, sp);
+    }
+    // grown by one pixel, since occluders cover the pixels whose center they cover, which may show the box
+    // through the rest, and at least one of the neighbours of such a pixel is then not covered by them
+    auto i0 = max(0,(int)floor(smin.x)-1), i1 = min(occlusion->width-1,(int)floor(smax.x)+1);
+    auto j0 = max(0,(int)floor(smin.y)-1), j1 = min(occlusion->height-1,(int)floor(smax.y)+1);
+    if(i0 > i1 or j0 > j1) return true;
+    // pick the level where the rectangle covers at most 4x4 texels
+    auto level = 0;
+    while(level+1 < (int)occlusion->levels.size() and max(i1-i0,j1-j0) >= 4) { i0 /= 2; i1 /= 2; j0 /= 2; j1 /= 2; level++; }
+    auto w = occlusion->width;
+    for(auto k = 0; k < level; k++) w = max(1,(w+1)/2);
+    auto& depth = occlusion->levels[level];
+    // visible if any texel has an occluder farther than the box
+    for(auto j = j0; j <= j1; j++) {
+        for(auto i = i0; i <= i1; i++) {
+            if(depth[j*w+i] >= smin.z) return true;
+        }
+    }
+    return false;
+}
+
+vector<MeshVisibility> cull_scene(Scene* scene, float far, OcclusionBuffer* occlusion, CullingStats* stats) {
+    auto frustum = make_frustum(scene->camera, far);
+    auto visibility = vector<MeshVisibility>();
+    // frustum and backface culling
+    for(auto mesh : get_display_meshes(scene)) {
+        auto culling = scene->draw_culling and mesh->culling;
+        // cull the mesh, or each of its instances, and group the visible ones by level of detail
+        auto frames = (mesh->instances.empty()) ? vector<frame3f>(1,mesh->frame) : mesh->instances;
+        auto lods = vector<MeshVisibility>();
+        for(auto& frame : frames) {
+            stats->meshes++;
+            if(culling and not frustum_overlap(frustum, transform_bbox(frame, mesh->culling->bbox))) { stats->meshes_culled++; continue; }
+            auto lod = (scene->draw_lod) ? select_lod(mesh, frame, scene->camera, scene->image_height, scene->lod_pixel_error) : mesh;
+            auto idx = 0;
+            while(idx < (int)lods.size() and lods[idx].mesh != lod) idx++;
+            if(idx == (int)lods.size()) { lods.push_back(MeshVisibility()); lods.back().mesh = lod; }
+            if(not mesh->instances.empty()) lods[idx].instances.push_back(frame);
+        }
+        for(auto& vis : lods) {
+            auto lod = vis.mesh;
+            if(not lod->culling) { visibility.push_back(vis); continue; }
+            // clusters are only culled for non-instanced meshes
+            auto backface = culling and scene->draw_backface_culling and not lod->mat->double_sided;
+            auto eye = transform_point_inverse(lod->frame, scene->camera->frame.o);
+            for(auto c : range(lod->culling->clusters.size())) {
+                auto& cluster = lod->culling->clusters[c];
+                if(culling and lod->instances.empty()) {
+                    stats->clusters++;
+                    if(not frustum_overlap(frustum, transform_bbox(lod->frame, cluster.bbox))) { stats->clusters_culled++; continue; }
+                    if(backface and cluster_backfacing(cluster, eye)) { stats->clusters_backface++; continue; }
+                }
+                vis.clusters.push_back(c);
+            }
+            if(vis.clusters.empty() and lod->line.empty() and lod->spline.empty() and not lod->hair) continue;
+            visibility.push_back(vis);
+        }
+    }
+    if(not occlusion or not scene->draw_culling or not scene->draw_occlusion_culling) return visibility;
+    
+    // pick the largest visible clusters of opaque non-instanced meshes as occluders
+    clear_occlusion(occlusion, scene->camera);
+    auto occluders = vector<pair<float,pair<Mesh*,int>>>();
+    for(auto& vis : visibility) {
+        if(not vis.mesh->instances.empty() or not vis.mesh->line.empty()) continue;
+        for(auto c : vis.clusters) {
+            auto bbox = transform_bbox(vis.mesh->frame, vis.mesh->culling->clusters[c].bbox);
+            auto d = max(dist(center(bbox), scene->camera->frame.o), scene->camera->dist);
+            occluders.push_back({ lengthSqr(size(bbox)) / (d*d), {vis.mesh,c} });
+        }
+    }
+    std::sort(occluders.begin(), occluders.end(),
+              [](const pair<float,pair<Mesh*,int>>& a, const pair<float,pair<Mesh*,int>>& b){ return a.first > b.first; });
+    for(auto& occluder : occluders) {
+        if(stats->occluder_triangles >= occlusion->triangle_budget) break;
+        auto mesh = occluder.second.first;
+        stats->occluder_triangles += rasterize_occluder(occlusion, mesh, mesh->culling->clusters[occluder.second.second]);
+    }
+    build_occlusion_hierarchy(occlusion);
+    
+    // test meshes, instances and clusters against the occluders
+    auto visible = vector<MeshVisibility>();
+    for(auto& vis : visibility) {
+        auto mesh = vis.mesh;
+        if(not mesh->culling) { visible.push_back(vis); continue; }
+        if(mesh->instances.empty()) {
+            if(not occlusion_visible(occlusion, transform_bbox(mesh->frame, mesh->culling->bbox))) { stats->meshes_occluded++; continue; }
+            auto clusters = vector<int>();
+            for(auto c : vis.clusters) {
+                if(occlusion_visible(occlusion, transform_bbox(mesh->frame, mesh->culling->clusters[c].bbox))) clusters.push_back(c);
+                else stats->clusters_occluded++;
+            }
+            vis.clusters = clusters;
+            if(vis.clusters.empty() and mesh->line.empty() and mesh->spline.empty() and not mesh->hair) continue;
+        } else {
+            auto instances = vector<frame3f>();
+            for(auto& frame : vis.instances) {
+                if(occlusion_visible(occlusion, transform_bbox(frame, mesh->culling->bbox))) instances.push_back(frame);
+                else stats->meshes_occluded++;
+            }
+            vis.instances = instances;
+            if(vis.instances.empty()) continue;
+        }
+        visible.push_back(vis);
+    }
+    return visible;
+}
+
+// distance from a point to the nearest point of a bounding box (zero inside)
+float _bbox_distance(const range3f& bbox, const vec3f& p) {
+    return dist(p, clamp(p, bbox.min, bbox.max));
+}
+
+void sort_front_to_back(vector<MeshVisibility>& visibility, Camera* camera) {
+    auto eye = camera->frame.o;
+    auto distances = vector<pair<float,int>>();
+    for(auto i : range(visibility.size())) {
+        auto& vis = visibility[i];
+        auto mesh = vis.mesh;
+        auto d = HUGE_VALF;
+        if(not mesh->culling) d = dist(eye, mesh->frame.o);
+        else if(vis.instances.empty()) d = _bbox_distance(transform_bbox(mesh->frame, mesh->culling->bbox), eye);
+        else for(auto& instance : vis.instances) d = min(d, _bbox_distance(transform_bbox(instance, mesh->culling->bbox), eye));
+        distances.push_back({d, i});
+    }
+    std::stable_sort(distances.begin(), distances.end(), [](const pair<float,int>& a, const pair<float,int>& b){ return a.first < b.first; });
+    auto sorted = vector<MeshVisibility>();
+    sorted.reserve(visibility.size());
+    for(auto& d : distances) sorted.push_back(std::move(visibility[d.second]));
+    visibility = std::move(sorted);
+}
+
+void print_stats(const CullingStats& stats) {
+    message("meshes: %d tested, %d outside the view, %d occluded\n", stats.meshes, stats.meshes_culled, stats.meshes_occluded);
+    message("clusters: %d tested, %d outside the view, %d backfacing, %d occluded\n",
+            stats.clusters, stats.clusters_culled, stats.clusters_backface, stats.clusters_occluded);
+    message("occluder triangles: %d, draws: %d, triangles: %d\n", stats.occluder_triangles, stats.draws, stats.triangles);
+}
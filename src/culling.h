@@ -0,0 +1,87 @@
+#ifndef _CULLING_H_
+#define _CULLING_H_
+
+#include "scene.h"
+
+// maximum number of faces in a culling cluster
+const int culling_cluster_size = 256;
+
+// view frustum as six planes (xyz normal pointing inside, w offset) in world coordinates
+struct Frustum {
+    vec4f planes[6];
+};
+
+// low resolution software depth buffer with a hierarchy of farthest depths,
+// rasterized from the largest occluders each frame to test bounding boxes against
+struct OcclusionBuffer {
+    int                     width = 256;            // resolution in x
+    int                     height = 128;           // resolution in y
+    int                     triangle_budget = 8192; // maximum number of occluder triangles per frame
+    vector<vector<float>>   levels;                 // view distances (level 0 nearest occluder, then farthest of 2x2 blocks)
+    Camera                  camera;                 // camera the buffer was rendered from
+};
+
+// culling statistics for one frame
+struct CullingStats {
+    int meshes = 0;             // meshes (or mesh instances) tested
+    int meshes_culled = 0;      // meshes (or mesh instances) outside the frustum
+    int meshes_occluded = 0;    // meshes (or mesh instances) hidden by occluders
+    int clusters = 0;           // clusters tested
+    int clusters_culled = 0;    // clusters outside the frustum
+    int clusters_backface = 0;  // clusters facing away from the camera
+    int clusters_occluded = 0;  // clusters hidden by occluders
+    int occluder_triangles = 0; // triangles rasterized in the occlusion buffer
+    int draws = 0;              // element ranges submitted
+    int triangles = 0;          // triangles submitted (quads count as two)
+};
+
+// visible parts of a mesh for one frame
+struct MeshVisibility {
+    Mesh*                   mesh = nullptr; // mesh
+    vector<frame3f>         instances;      // visible instance frames (empty if the mesh is not instanced)
+    vector<int>             clusters;       // visible clusters
+};
+
+// compute mesh bounds and split faces into clusters with bounds and normal cones (call after subdivision)
+// reorders triangles and quads along a Morton curve so that each cluster is a contiguous range
+void compute_bounds(Mesh* mesh);
+
+// compute bounds for all display meshes in the scene
+void compute_bounds(Scene* scene);
+
+// make the camera view frustum, from the image plane to the far distance
+Frustum make_frustum(Camera* camera, float far);
+
+// transform a bounding box by a frame, returning the box enclosing the transformed one
+range3f transform_bbox(const frame3f& frame, const range3f& bbox);
+
+// check whether a bounding box in world coordinates is at least partially inside the frustum
+bool frustum_overlap(const Frustum& frustum, const range3f& bbox);
+
+// check whether all faces of a cluster face away from a viewpoint (in mesh coordinates)
+bool cluster_backfacing(const MeshCulling::Cluster& cluster, const vec3f& eye);
+
+// clear the occlusion buffer for a camera
+void clear_occlusion(OcclusionBuffer* occlusion, Camera* camera);
+
+// rasterize the faces of a cluster into the occlusion buffer, returning the number of triangles drawn
+int rasterize_occluder(OcclusionBuffer* occlusion, Mesh* mesh, const MeshCulling::Cluster& cluster);
+
+// build the farthest depth hierarchy after all occluders are rasterized
+void build_occlusion_hierarchy(OcclusionBuffer* occlusion);
+
+// check whether a bounding box in world coordinates may be visible past the occluders
+bool occlusion_visible(OcclusionBuffer* occlusion, const range3f& bbox);
+
+// find the visible meshes, instances and clusters using frustum, backface and occlusion culling
+// as enabled in the scene (occlusion may be null to disable it)
+vector<MeshVisibility> cull_scene(Scene* scene, float far, OcclusionBuffer* occlusion, CullingStats* stats);
+
+// sort the visible meshes front to back by the distance of the nearest point of their bounds
+// (or of their nearest visible instance) to the camera, so that early depth testing skips hidden fragments
+void sort_front_to_back(vector<MeshVisibility>& visibility, Camera* camera);
+
+// print culling statistics
+void print_stats(const CullingStats& stats);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "common.h"
 
+#include <cstring>
+
 #ifdef _WIN32
 #pragma warning (disable: 4224)
 #define GLEW_STATIC
@@ -23,6 +25,17 @@ inline void error_if_glerror() {
     
 }
 
+// check if an OpenGL extension is supported by the current context
+inline bool gl_has_extension(const char* name) {
+    auto extensions = (const char*)glGetString(GL_EXTENSIONS);
+    if(not extensions) return false;
+    auto len = strlen(name);
+    for(auto s = strstr(extensions, name); s; s = strstr(s+len, name)) {
+        if((s == extensions or s[-1] == ' ') and (s[len] == ' ' or s[len] == 0)) return true;
+    }
+    return false;
+}
+
 // check if an OpenGL shader is compiled
 inline void error_if_shader_not_valid(int shader_id) {
     int iscompiled;
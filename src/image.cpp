@@ -179,3 +179,136 @@ void write_png(const string& filename, const image3f& img, bool flipY) {
     unsigned error = lodepng::encode(filename, img_png, img.width(), img.height());
     error_if_not(not error, "cannot write png image: %s", filename.c_str());
 }
+
+// write a PNG chunk, with its length, type, data and crc
+static void _write_png_chunk(PngStream* png, const char* type, const vector<unsigned char>& data) {
+    auto chunk = vector<unsigned char>(type, type+4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    auto crc = lodepng_crc32(chunk.data(), chunk.size());
+    unsigned char length[4] = { (unsigned char)(data.size() >> 24), (unsigned char)(data.size() >> 16),
+                                (unsigned char)(data.size() >> 8), (unsigned char)data.size() };
+    unsigned char crc_bytes[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+    auto ok = fwrite(length, 1, 4, png->file) == 4 and fwrite(chunk.data(), 1, chunk.size(), png->file) == chunk.size() and
+              fwrite(crc_bytes, 1, 4, png->file) == 4;
+    error_if_not(ok, "error writing png image");
+}
+
+// append bits to the deflate stream, least significant first
+static void _put_bits(PngStream* png, unsigned int value, int count) {
+    png->bits |= value << png->bits_count;
+    png->bits_count += count;
+    while(png->bits_count >= 8) {
+        png->data.push_back(png->bits & 0xff);
+        png->bits >>= 8;
+        png->bits_count -= 8;
+    }
+}
+
+// append a Huffman code to the deflate stream, most significant bit first
+static void _put_code(PngStream* png, unsigned int code, int count) {
+    auto reversed = 0u;
+    for(auto i = 0; i < count; i++) reversed |= ((code >> i) & 1) << (count-1-i);
+    _put_bits(png, reversed, count);
+}
+
+// append a literal or length symbol with the fixed Huffman codes
+static void _put_symbol(PngStream* png, int symbol) {
+    if(symbol < 144) _put_code(png, 0x30 + symbol, 8);
+    else if(symbol < 256) _put_code(png, 0x190 + symbol - 144, 9);
+    else if(symbol < 280) _put_code(png, symbol - 256, 7);
+    else _put_code(png, 0xc0 + symbol - 280, 8);
+}
+
+// append a match of length 3 to 258 at a distance of 1 to 32768
+static void _put_match(PngStream* png, int length, int distance) {
+    static const int length_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+    static const int length_extra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+    static const int distance_base[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,
+                                           1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+    auto c = 28;
+    while(length_base[c] > length) c--;
+    _put_symbol(png, 257 + c);
+    _put_bits(png, length - length_base[c], length_extra[c]);
+    auto d = 29;
+    while(distance_base[d] > distance) d--;
+    _put_code(png, d, 5);
+    _put_bits(png, distance - distance_base[d], max(0, d/2-1));
+}
+
+// update the adler32 checksum with uncompressed data
+static void _update_adler(PngStream* png, const unsigned char* data, int size) {
+    // sums fit 32 bits for 5552 bytes before taking the modulo
+    while(size > 0) {
+        auto count = min(size, 5552);
+        for(auto i = 0; i < count; i++) {
+            png->adler_a += data[i];
+            png->adler_b += png->adler_a;
+        }
+        png->adler_a %= 65521;
+        png->adler_b %= 65521;
+        data += count;
+        size -= count;
+    }
+}
+
+PngStream* open_png_stream(const string& filename, int width, int height) {
+    auto png = new PngStream();
+    png->file = fopen(filename.c_str(), "wb");
+    error_if_not(png->file != 0, "failed to create image file %s", filename.c_str());
+    png->width = width;
+    png->height = height;
+    const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    error_if_not(fwrite(signature, 1, 8, png->file) == 8, "error writing file %s", filename.c_str());
+    // 8-bit RGB, no interlacing
+    auto header = vector<unsigned char>{ (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+        (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height, 8, 2, 0, 0, 0 };
+    _write_png_chunk(png, "IHDR", header);
+    // zlib header, then a single final deflate block with fixed Huffman codes
+    png->data = { 0x78, 0x01 };
+    _put_bits(png, 1, 1);
+    _put_bits(png, 1, 2);
+    return png;
+}
+
+void write_png_rows(PngStream* png, const unsigned char* pixels, int rows) {
+    error_if_not(png->rows + rows <= png->height, "too many png rows");
+    auto size = png->width*3;
+    for(auto j = 0; j < rows; j++) {
+        // rows are not filtered, repeated pixels match at distance 3 and repeated rows at the row size
+        // (with the filter byte)
+        auto row = pixels + j*size;
+        const unsigned char filter = 0;
+        _put_symbol(png, filter);
+        _update_adler(png, &filter, 1);
+        _update_adler(png, row, size);
+        auto previous = (png->previous.empty()) ? nullptr : png->previous.data();
+        auto i = 0;
+        while(i < size) {
+            auto length = 0, up = 0;
+            if(i >= 3) while(i + length < size and length < 258 and row[i+length] == row[i+length-3]) length++;
+            if(previous) while(i + up < size and up < 258 and row[i+up] == previous[i+up]) up++;
+            if(up > length and up >= 3) { _put_match(png, up, size+1); i += up; }
+            else if(length >= 3) { _put_match(png, length, 3); i += length; }
+            else _put_symbol(png, row[i++]);
+        }
+        if(size+1 <= 32768) png->previous.assign(row, row+size);
+        if(png->data.size() >= 1 << 16) {
+            _write_png_chunk(png, "IDAT", png->data);
+            png->data.clear();
+        }
+    }
+    png->rows += rows;
+}
+
+void close_png_stream(PngStream* png) {
+    error_if_not(png->rows == png->height, "missing png rows");
+    // end of block, padding to a byte, then the checksum of the uncompressed data
+    _put_symbol(png, 256);
+    if(png->bits_count) _put_bits(png, 0, 8 - png->bits_count);
+    auto adler = (png->adler_b << 16) | png->adler_a;
+    png->data.insert(png->data.end(), { (unsigned char)(adler >> 24), (unsigned char)(adler >> 16), (unsigned char)(adler >> 8), (unsigned char)adler });
+    _write_png_chunk(png, "IDAT", png->data);
+    _write_png_chunk(png, "IEND", vector<unsigned char>());
+    fclose(png->file);
+    delete png;
+}
@@ -73,6 +73,28 @@ void write_pfm(const string& filename, const image3f& img, bool flipY = false);
 // Write an 8-bit color compressed PNG file (sets PNG alpha to 1 everywhere)
 void write_png(const string& filename, const image3f& img, bool flipY = false);
 
+// PNG file written a band of rows at a time, so that images larger than memory can be saved;
+// rows are deflated as they arrive, matching the previous pixel or the previous row, with fixed Huffman codes
+struct PngStream {
+    FILE*                   file = nullptr;     // file
+    int                     width = 0;          // image width
+    int                     height = 0;         // image height
+    int                     rows = 0;           // rows written so far
+    vector<unsigned char>   data;               // compressed data not yet written in a chunk
+    vector<unsigned char>   previous;           // previous row (empty if not in the deflate window)
+    unsigned int            bits = 0;           // bits not yet written in data
+    int                     bits_count = 0;     // number of bits not yet written in data
+    unsigned int            adler_a = 1;        // adler32 checksum of the uncompressed data (low half)
+    unsigned int            adler_b = 0;        // adler32 checksum of the uncompressed data (high half)
+};
+
+// Start writing an 8-bit color PNG file of the given size
+PngStream* open_png_stream(const string& filename, int width, int height);
+// Write rows of 8-bit RGB pixels, from the top, to a PNG file
+void write_png_rows(PngStream* png, const unsigned char* pixels, int rows);
+// Finish writing a PNG file once all rows are written, and delete the stream
+void close_png_stream(PngStream* png);
+
 // Load a PFM or PPM color image and return it as a floating point color image
 image3f read_pnm(const string& filename, bool flipY);
 // Load a compressed PNG color image and return it as a floating point color image
@@ -0,0 +1,170 @@
+#include "lights.h"
+#include "culling.h"
+
+#include <chrono>
+#include <random>
+
+float light_radius(Light* light, float cutoff) {
+    auto intensity = max(light->intensity.x, max(light->intensity.y, light->intensity.z));
+    if(intensity <= 0) return 0;
+    return sqrt(intensity / cutoff);
+}
+
+// light spheres in camera coordinates, stored by component and padded to a multiple of four
+// with spheres of negative radius that overlap nothing
+struct _LightSpheres {
+    vector<float> x, y, z, r;
+};
+
+// for each sphere, the first and last cell overlapping it in a row of cells separated by planes
+// (a,b,w) with distance a*u + b*z + w from each sphere center (u,z), positive towards the next cell;
+// a cell overlaps a sphere if it is not outside either of its planes (empty if first > last)
+void _overlap_cells(const vector<float>& u, const vector<float>& z, const vector<float>& r,
+                    const vector<vec3f>& planes, vector<float>& first, vector<float>& last) {
+    first.resize(r.size());
+    last.resize(r.size());
+    for(auto l = 0; l < (int)r.size(); l += 4) {
+        auto pu = load4(&u[l]), pz = load4(&z[l]), pr = load4(&r[l]);
+        auto nr = madd(pr, splat4(-1), splat4(0));
+        auto lo = splat4(HUGE_VALF), hi = splat4(-1);
+        auto distance = [&](const vec3f& p){ return madd(splat4(p.x), pu, madd(splat4(p.y), pz, splat4(p.z))); };
+        auto inside = cmpge(distance(planes[0]), nr);
+        for(auto c = 0; c+1 < (int)planes.size(); c++) {
+            auto d = distance(planes[c+1]);
+            auto overlap = mask_and(inside, cmple(d, pr));
+            lo = min(lo, select(overlap, splat4(c), splat4(HUGE_VALF)));
+            hi = max(hi, select(overlap, splat4(c), splat4(-1)));
+            inside = cmpge(d, nr);
+        }
+        store4(&first[l], lo);
+        store4(&last[l], hi);
+    }
+}
+
+// planes through the camera center separating tiles, from the image plane coordinates of the tile edges
+// (tiles start at pixel origin)
+vector<vec3f> _tile_planes(int tiles, int origin, float image_size, float camera_size, float dist) {
+    auto planes = vector<vec3f>();
+    for(auto t : range(tiles+1)) {
+        auto u = ((origin + t * light_tile_size) / image_size - 0.5f) * camera_size;
+        auto l = sqrt(dist*dist + u*u);
+        planes.push_back(vec3f(dist/l, u/l, 0));
+    }
+    return planes;
+}
+
+void bin_lights(Scene* scene, float far, LightGrid* grid, const vec2i& origin, const vec2i& size) {
+    auto start = std::chrono::high_resolution_clock::now();
+    auto camera = scene->camera;
+    auto region = (size.x > 0 and size.y > 0) ? size : vec2i(scene->image_width, scene->image_height);
+    grid->tiles_x = (region.x + light_tile_size-1) / light_tile_size;
+    grid->tiles_y = (region.y + light_tile_size-1) / light_tile_size;
+    grid->slices = light_slices;
+    grid->lights.clear();
+    grid->data.clear();
+    grid->indices.clear();
+
+    // keep the lights that reach the view, in camera coordinates
+    auto frustum = make_frustum(camera, far);
+    auto spheres = _LightSpheres();
+    for(auto light : scene->lights) {
+        auto radius = light_radius(light, scene->light_cutoff);
+        if(radius <= 0) continue;
+        auto pos = light->frame.o;
+        if(not frustum_overlap(frustum, range3f(pos-vec3f(radius,radius,radius), pos+vec3f(radius,radius,radius)))) continue;
+        auto cp = transform_point_inverse(camera->frame, pos);
+        spheres.x.push_back(cp.x); spheres.y.push_back(cp.y); spheres.z.push_back(cp.z); spheres.r.push_back(radius);
+        grid->lights.push_back(light);
+        grid->data.push_back(vec4f(pos.x, pos.y, pos.z, radius));
+        grid->data.push_back(vec4f(light->intensity.x, light->intensity.y, light->intensity.z, 0));
+    }
+    auto count = (int)spheres.r.size();
+    while(spheres.r.size() % 4) { spheres.x.push_back(0); spheres.y.push_back(0); spheres.z.push_back(0); spheres.r.push_back(-1); }
+
+    // slices span the lights view distances, fragments nearer than all lights fall in the first slice
+    grid->near = HUGE_VALF;
+    grid->far = 0;
+    for(auto l : range(count)) {
+        grid->near = min(grid->near, -spheres.z[l] - spheres.r[l]);
+        grid->far = max(grid->far, -spheres.z[l] + spheres.r[l]);
+    }
+    // without lights, slices span the camera depth range (they are all empty)
+    if(not count) { grid->near = camera->dist; grid->far = far; }
+    grid->near = max(grid->near, camera->dist);
+    grid->far = max(min(grid->far, far), 2*grid->near);
+
+    // find the tile columns, tile rows and slices overlapping each light
+    auto slice_planes = vector<vec3f>();
+    for(auto k : range(grid->slices+1)) slice_planes.push_back(vec3f(0, -1, -grid->near * pow(grid->far/grid->near, k/(float)grid->slices)));
+    auto x0 = vector<float>(), x1 = vector<float>(), y0 = vector<float>(), y1 = vector<float>(), k0 = vector<float>(), k1 = vector<float>();
+    _overlap_cells(spheres.x, spheres.z, spheres.r, _tile_planes(grid->tiles_x, origin.x, scene->image_width, camera->width, camera->dist), x0, x1);
+    _overlap_cells(spheres.y, spheres.z, spheres.r, _tile_planes(grid->tiles_y, origin.y, scene->image_height, camera->height, camera->dist), y0, y1);
+    _overlap_cells(spheres.x, spheres.z, spheres.r, slice_planes, k0, k1);
+
+    // count the lights of each cluster, then place each list after the previous ones
+    auto clusters = grid->tiles_x * grid->tiles_y * grid->slices;
+    auto cluster = [&](int i, int j, int k){ return (k*grid->tiles_y + j)*grid->tiles_x + i; };
+    auto lights = vector<int>(clusters, 0);
+    auto visible = vector<bool>(count, false);
+    auto total = 0;
+    grid->dropped = 0;
+    for(auto l : range(count)) {
+        if(x0[l] > x1[l] or y0[l] > y1[l] or k0[l] > k1[l]) continue;
+        auto size = (int)(x1[l]-x0[l]+1) * (int)(y1[l]-y0[l]+1) * (int)(k1[l]-k0[l]+1);
+        if(total + size > light_indices_max) { grid->dropped++; continue; }
+        total += size;
+        visible[l] = true;
+        for(auto k = (int)k0[l]; k <= k1[l]; k++) for(auto j = (int)y0[l]; j <= y1[l]; j++) for(auto i = (int)x0[l]; i <= x1[l]; i++) lights[cluster(i,j,k)]++;
+    }
+    auto offset = vector<int>(clusters, 0);
+    for(auto c = 1; c < clusters; c++) offset[c] = offset[c-1] + lights[c-1];
+    grid->clusters.resize(clusters);
+    for(auto c : range(clusters)) grid->clusters[c] = vec2f(offset[c], lights[c]);
+    grid->indices.resize(total);
+    for(auto l : range(count)) {
+        if(not visible[l]) continue;
+        for(auto k = (int)k0[l]; k <= k1[l]; k++) for(auto j = (int)y0[l]; j <= y1[l]; j++) for(auto i = (int)x0[l]; i <= x1[l]; i++) grid->indices[offset[cluster(i,j,k)]++] = l;
+    }
+    grid->time = std::chrono::duration<float,std::milli>(std::chrono::high_resolution_clock::now()-start).count();
+}
+
+vec2f light_slice_params(const LightGrid& grid) {
+    // all distances fall in the first slice for grids that were not binned
+    if(not (grid.near > 0 and grid.far > grid.near and grid.far < HUGE_VALF)) return zero2f;
+    auto scale = grid.slices / log(grid.far/grid.near);
+    return vec2f(scale, -log(grid.near)*scale);
+}
+
+void add_random_lights(Scene* scene, int count) {
+    if(count <= 0) return;
+    auto bbox = range3f();
+    for(auto mesh : scene->meshes) {
+        for(auto& p : mesh->pos) bbox = runion(bbox, transform_point(mesh->frame, p));
+    }
+    if(not isvalid(bbox)) bbox = range3f(-one3f, one3f);
+    // lights are placed in the bounds grown by a tenth of their largest size, with radii of twice their average spacing
+    // so that about the same number of lights reaches each point whatever the count
+    auto s = size(bbox);
+    auto grow = vec3f(1,1,1) * max(s.x, max(s.y, s.z)) * 0.1f;
+    bbox = range3f(bbox.min - grow, bbox.max + grow);
+    s = size(bbox);
+    auto spacing = pow(s.x*s.y*s.z / count, 1/3.0f);
+    auto intensity = scene->light_cutoff * 4 * spacing * spacing;
+    std::mt19937 generator(count);
+    std::uniform_real_distribution<float> uniform(0,1);
+    for(auto i = 0; i < count; i++) {
+        auto light = new Light();
+        light->frame.o = bbox.min + s * vec3f(uniform(generator), uniform(generator), uniform(generator));
+        auto color = vec3f(0.5f,0.5f,0.5f) + vec3f(uniform(generator), uniform(generator), uniform(generator)) * 0.5f;
+        light->intensity = color * intensity;
+        scene->lights.push_back(light);
+    }
+}
+
+void print_stats(const LightGrid& grid) {
+    auto max_count = 0, used = 0;
+    for(auto& c : grid.clusters) { max_count = max(max_count, (int)c.y); used += c.y > 0; }
+    message("lights: %d in view, %d dropped, %dx%dx%d clusters (%d lit), %d light indices, %.2f lights per lit cluster (max %d), binned in %.3f ms\n",
+            (int)grid.lights.size(), grid.dropped, grid.tiles_x, grid.tiles_y, grid.slices, used, (int)grid.indices.size(),
+            grid.indices.size() / (float)max(1,used), max_count, grid.time);
+}
@@ -0,0 +1,56 @@
+#ifndef _LIGHTS_H_
+#define _LIGHTS_H_
+
+#include "scene.h"
+
+// size of the screen tiles lights are binned in (pixels)
+const int light_tile_size = 16;
+
+// number of depth slices of each screen tile, spaced exponentially between the nearest
+// and the farthest light
+const int light_slices = 24;
+
+// width of the textures the light data and light indices are stored in
+const int light_texture_width = 1024;
+
+// maximum number of light indices, keeping indices exact as floats and the index texture
+// within 4096 rows; lights past it are dropped
+const int light_indices_max = 1 << 22;
+
+// lights binned over clusters of the view frustum (froxels), each a screen tile cut to a depth slice,
+// with one list of light indices per cluster
+struct LightGrid {
+    int             tiles_x = 0;    // number of tiles in x
+    int             tiles_y = 0;    // number of tiles in y
+    int             slices = 0;     // number of depth slices
+    float           near = 1;       // view distance of the first slice start
+    float           far = 1;        // view distance of the last slice end
+    vector<Light*>  lights;         // lights in view
+    vector<vec4f>   data;           // two texels per light in view: position and radius, intensity
+    vector<vec2f>   clusters;       // first index and number of lights of each cluster, by slice, then tile row
+                                    // from the bottom, then tile column (as floats for textures)
+    vector<float>   indices;        // light indices of all clusters (as floats for textures)
+    int             dropped = 0;    // lights dropped for exceeding the light indices maximum
+    float           time = 0;       // binning time (ms)
+};
+
+// distance beyond which the light intensity falls below cutoff
+float light_radius(Light* light, float cutoff);
+
+// bin the lights over the view frustum clusters they may affect, for a camera with far distance far,
+// over the image region of size pixels at origin (the whole image if size is zero), with tiles
+// starting at the region origin
+void bin_lights(Scene* scene, float far, LightGrid* grid, const vec2i& origin = zero2i, const vec2i& size = zero2i);
+
+// scale and bias of the slice of a view distance z, floor(log(z) * scale + bias), as computed by the shader
+// (zero if the grid has no depth range, so that all distances fall in the first slice)
+vec2f light_slice_params(const LightGrid& grid);
+
+// add count random point lights within the scene bounds, with intensities scaled so that the
+// lighting does not depend on count (for benchmarking)
+void add_random_lights(Scene* scene, int count);
+
+// print light binning statistics
+void print_stats(const LightGrid& grid);
+
+#endif
@@ -3,60 +3,214 @@
 #include "scene.h"
 #include "image.h"
 #include "tesselation.h"
+#include "culling.h"
+#include "simplify.h"
+#include "optimize.h"
+#include "compress.h"
+#include "shader.h"
+#include "lights.h"
+#include "shadows.h"
 
 #include <cstdio>
+#include <chrono>
+
+// far distance of the camera projection
+const float camera_far = 10000;
+
+// largest tile of offscreen captures (captures larger than it are rendered in tiles)
+const int capture_tile_size = 1024;
+
+// OpenGL buffers for a mesh, uploaded once at startup
+struct MeshBuffers {
+    unsigned int pos_id = 0;        // vertex position buffer
+    unsigned int norm_id = 0;       // vertex normal buffer
+    unsigned int texcoord_id = 0;   // vertex texture coordinate buffer
+    unsigned int face_id = 0;       // face element buffer (triangles, then quads split along their shorter diagonal)
+    unsigned int line_id = 0;       // line element buffer (lines and spline control polygons)
+    unsigned int edge_id = 0;       // wireframe edge element buffer
+    unsigned int instance_id = 0;   // instance frames buffer (column-major 4x4 matrices)
+    int face_type = GL_UNSIGNED_INT;    // face index type (16-bit indices are relative to the batch first vertex)
+    int line_type = GL_UNSIGNED_INT;    // line and edge index type
+    vector<int> batch_base;         // first vertex of each batch of faces
+    vector<vec3i> cluster_faces;    // batch, first index and index count of the faces of each cluster (or of the whole mesh)
+    bool compressed = false;        // whether vertex data is compressed (positions quantized, octahedral normals)
+    int texcoord_type = GL_FLOAT;   // texture coordinate type (half floats when compressed and supported)
+    vec3f pos_offset = zero3f;      // offset of quantized positions
+    vec3f pos_scale = one3f;        // scale of quantized positions
+    int line_count = 0;             // number of line indices
+    int edge_count = 0;             // number of edge indices
+    int instance_count = 0;         // number of instances currently in the buffer
+    unsigned int hair_pos_id = 0;       // hair strand vertex buffer (each vertex twice for ribbons)
+    unsigned int hair_tangent_id = 0;   // hair strand tangent buffer
+    unsigned int hair_side_id = 0;      // hair ribbon side buffer (-1 and 1 for the two copies of each vertex, ribbons only)
+    unsigned int hair_texcoord_id = 0;  // hair root texture coordinate buffer, at each strand vertex (textured materials only)
+    vector<int> hair_first;         // first vertex of each strand
+    vector<int> hair_count;         // vertex count of each strand
+};
+
+// offscreen render target, multisampled and resolved to a single sample framebuffer to read if supported
+struct RenderTarget {
+    int width = 0;                  // width
+    int height = 0;                 // height
+    int samples = 0;                // multisample antialiasing samples (zero if not multisampled)
+    unsigned int framebuffer_id = 0;        // framebuffer rendered to
+    unsigned int color_id = 0;              // color renderbuffer
+    unsigned int depth_id = 0;              // depth renderbuffer
+    unsigned int resolve_framebuffer_id = 0;// single sample framebuffer the multisampled one is resolved to
+    unsigned int resolve_color_id = 0;      // single sample color renderbuffer
+};
 
 // OpenGL state for shading
 struct ShadeState {
-    int gl_program_id = 0;          // OpenGL program handle
-    int gl_vertex_shader_id = 0;    // OpenGL vertex shader handle
-    int gl_fragment_shader_id = 0;  // OpenGL fragment shader handle
+    ShaderCache shaders;            // shader permutations
+    int gl_program_id = 0;          // OpenGL program handle currently in use
     map<image3f*,int> gl_texture_id;// OpenGL texture handles
+    map<Mesh*,MeshBuffers> gl_mesh_buffers; // OpenGL mesh buffers
+    bool gl_instancing = false;     // whether instanced drawing is supported
+    bool gl_compressed = false;     // whether to upload compressed vertex data
+    bool gl_half_float = false;     // whether half float vertex attributes are supported
+    bool gl_float_textures = false; // whether float textures are supported to store binned lights
+    unsigned int light_data_id = 0;     // light positions, radii and intensities texture
+    unsigned int light_clusters_id = 0; // first light index and light count of each cluster texture
+    unsigned int light_indices_id = 0;  // light indices of all clusters texture
+    unsigned int light_shadows_id = 0;  // shadow map of each light in view texture
+    bool gl_framebuffers = false;   // whether framebuffer objects are supported (offscreen captures and shadow maps)
+    bool gl_multisample_framebuffers = false;   // whether multisampled framebuffer objects and their resolve are supported
+    bool gl_shadows = false;        // whether framebuffer objects are supported to render shadow maps
+    unsigned int shadow_texture_id = 0;     // shadow maps depth atlas
+    unsigned int shadow_framebuffer_id = 0; // framebuffer rendering to the shadow atlas
+    unsigned int fragments_query_id = 0;    // query counting the fragments shaded in the last frame
+    int gl_samples = 0;             // multisample antialiasing samples per pixel of the framebuffer
+    vec2f jitter = zero2f;          // sub-pixel offset of the camera projection (pixels), for accumulated antialiasing
+    unsigned int framebuffer_id = 0;// framebuffer the image is rendered to (zero for the window)
+    vec2i tile_origin = zero2i;     // pixel origin of the image tile rendered
+    vec2i tile_size = zero2i;       // pixel size of the image tile rendered (the whole image if zero)
+    OcclusionBuffer occlusion;      // software occlusion buffer
+    CullingStats stats;             // culling statistics for the last frame
+    LightGrid lights;               // lights binned over view clusters for the last frame
+    ShadowAtlas shadows;            // shadow maps of the most important lights
 };
 
-// initialize the shaders
-void init_shaders(ShadeState* state) {
-    // load shader code from files
-    auto vertex_shader_code = load_text_file("model_vertex.glsl");
-    auto fragment_shader_code = load_text_file("model_fragment.glsl");
-    auto vertex_shader_codes = (char *)vertex_shader_code.c_str();
-    auto fragment_shader_codes = (char *)fragment_shader_code.c_str();
+// whether lights are shaded from the cluster lists
+bool _clustered_lights(Scene* scene, ShadeState* state) {
+    return scene->draw_clustered_lights and state->gl_float_textures;
+}
 
-    // create shaders
-    state->gl_vertex_shader_id = glCreateShader(GL_VERTEX_SHADER);
-    state->gl_fragment_shader_id = glCreateShader(GL_FRAGMENT_SHADER);
-    
-    // load shaders code onto the GPU
-    glShaderSource(state->gl_vertex_shader_id,1,(const char**)&vertex_shader_codes,nullptr);
-    glShaderSource(state->gl_fragment_shader_id,1,(const char**)&fragment_shader_codes,nullptr);
-    
-    // compile shaders
-    glCompileShader(state->gl_vertex_shader_id);
-    glCompileShader(state->gl_fragment_shader_id);
-    
-    // check if shaders are valid
-    error_if_glerror();
-    error_if_shader_not_valid(state->gl_vertex_shader_id);
-    error_if_shader_not_valid(state->gl_fragment_shader_id);
-    
-    // create program
-    state->gl_program_id = glCreateProgram();
-    
-    // attach shaders
-    glAttachShader(state->gl_program_id,state->gl_vertex_shader_id);
-    glAttachShader(state->gl_program_id,state->gl_fragment_shader_id);
-    
-    // bind vertex attributes locations
-    glBindAttribLocation(state->gl_program_id, 0, "vertex_pos");
-    glBindAttribLocation(state->gl_program_id, 1, "vertex_norm");
-    glBindAttribLocation(state->gl_program_id, 2, "vertex_texcoord");
+// whether lights are shadowed by shadow maps
+bool _shadows(Scene* scene, ShadeState* state) {
+    return scene->draw_shadows and state->gl_shadows;
+}
 
-    // link program
-    glLinkProgram(state->gl_program_id);
-    
-    // check if program is valid
+// feature set of the program used to draw a mesh
+int _mesh_features(Scene* scene, Mesh* mesh, ShadeState* state) {
+    auto features = shader_features(mesh->mat, not mesh->line.empty());
+    if(mesh->flat_shading and mesh->line.empty()) features |= shader_flat;
+    if(_clustered_lights(scene, state)) features |= shader_clustered_lights;
+    if(_shadows(scene, state)) features |= shader_shadows;
+    return features;
+}
+
+// feature set of the program used to draw the hair of a mesh
+int _hair_features(Scene* scene, Mesh* mesh, ShadeState* state) {
+    auto features = shader_features(mesh->mat, true);
+    if(mesh->mat->hair_width > 0) features |= shader_ribbons;
+    if(_clustered_lights(scene, state)) features |= shader_clustered_lights;
+    if(_shadows(scene, state)) features |= shader_shadows;
+    return features;
+}
+
+// whether the hair of a mesh is drawn as ribbons, which are also drawn in the depth pre-pass and
+// the shadow maps (hair drawn as lines is left out of both, like line sets)
+bool _hair_ribbons(Mesh* mesh) {
+    return mesh->hair and mesh->mat->hair_width > 0;
+}
+
+// initialize the shaders, building the permutations used by the scene materials
+void init_shaders(Scene* scene, ShadeState* state) {
+    init_shader_cache(&state->shaders);
+    state->gl_float_textures = gl_has_extension("GL_ARB_texture_float");
+    state->gl_framebuffers = gl_has_extension("GL_EXT_framebuffer_object");
+    state->gl_multisample_framebuffers = state->gl_framebuffers and
+        gl_has_extension("GL_EXT_framebuffer_multisample") and gl_has_extension("GL_EXT_framebuffer_blit");
+    state->gl_shadows = state->gl_framebuffers;
+    for(auto mesh : get_display_meshes(scene)) {
+        get_shader_program(&state->shaders, _mesh_features(scene, mesh, state));
+        if(mesh->hair) get_shader_program(&state->shaders, _hair_features(scene, mesh, state));
+        if(_hair_ribbons(mesh)) get_shader_program(&state->shaders, shader_depth_only | shader_ribbons);
+    }
+    if(state->gl_shadows) get_shader_program(&state->shaders, shader_depth_only);
+}
+
+// initialize the shadow atlas, a depth texture compared in the shader with hardware filtering,
+// and the framebuffer rendering to it (disabling shadows if the framebuffer is not supported)
+void init_shadows(ShadeState* state) {
+    if(not state->gl_shadows) return;
+    auto size = state->shadows.size;
+    glGenTextures(1, &state->shadow_texture_id);
+    glBindTexture(GL_TEXTURE_2D, state->shadow_texture_id);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glGenFramebuffersEXT(1, &state->shadow_framebuffer_id);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, state->shadow_framebuffer_id);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_TEXTURE_2D, state->shadow_texture_id, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    state->gl_shadows = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) == GL_FRAMEBUFFER_COMPLETE_EXT;
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, state->framebuffer_id);
+    if(not state->gl_shadows) message("shadow maps not supported\n");
     error_if_glerror();
-    error_if_program_not_valid(state->gl_program_id);
+}
+
+// utility to upload float data to a nearest filtered texture without mipmaps, in rows of width texels
+// (padded with zeros to fill the last row)
+void _upload_float_texture(unsigned int& id, int internal_format, int format, int channels,
+                           vector<float> data, int width) {
+    if(not id) {
+        glGenTextures(1, &id);
+        glBindTexture(GL_TEXTURE_2D, id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    } else glBindTexture(GL_TEXTURE_2D, id);
+    auto height = max(1, ((int)data.size()/channels + width-1) / width);
+    data.resize(width*height*channels, 0);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, GL_FLOAT, data.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// size of the image tile rendered
+vec2i _tile_size(Scene* scene, ShadeState* state) {
+    if(state->tile_size.x > 0 and state->tile_size.y > 0) return state->tile_size;
+    return vec2i(scene->image_width, scene->image_height);
+}
+
+// bin the lights over the view clusters and upload the light data and cluster lists
+void _update_lights(Scene* scene, ShadeState* state) {
+    auto& grid = state->lights;
+    bin_lights(scene, camera_far, &grid, state->tile_origin, _tile_size(scene, state));
+    auto data = (const float*)grid.data.data();
+    auto clusters = (const float*)grid.clusters.data();
+    _upload_float_texture(state->light_data_id, GL_RGBA32F_ARB, GL_RGBA, 4,
+                          vector<float>(data, data + grid.data.size()*4), light_texture_width);
+    _upload_float_texture(state->light_clusters_id, GL_LUMINANCE_ALPHA32F_ARB, GL_LUMINANCE_ALPHA, 2,
+                          vector<float>(clusters, clusters + grid.clusters.size()*2), grid.tiles_x);
+    _upload_float_texture(state->light_indices_id, GL_LUMINANCE32F_ARB, GL_LUMINANCE, 1,
+                          grid.indices, light_texture_width);
+    if(_shadows(scene, state)) {
+        auto shadows = vector<float>();
+        for(auto light : grid.lights) {
+            auto rect = shadow_rect(state->shadows, light);
+            shadows.insert(shadows.end(), &rect.x, &rect.x+4);
+        }
+        _upload_float_texture(state->light_shadows_id, GL_RGBA32F_ARB, GL_RGBA, 4, shadows, light_texture_width);
+    }
 }
 
 // initialize the textures
@@ -85,134 +239,908 @@ void init_textures(Scene* scene, ShadeState* state) {
     }
 }
 
+// utility to upload an array to a new OpenGL buffer
+template<typename T>
+unsigned int _make_buffer(int target, const vector<T>& data, int usage = GL_STATIC_DRAW) {
+    if(data.empty()) return 0;
+    unsigned int id = 0;
+    glGenBuffers(1, &id);
+    glBindBuffer(target, id);
+    glBufferData(target, data.size()*sizeof(T), data.data(), usage);
+    glBindBuffer(target, 0);
+    return id;
+}
+
+// utility to upload indices to a new element buffer, with 16-bit indices if short_indices is true
+unsigned int _make_index_buffer(const vector<int>& indices, bool short_indices) {
+    if(not short_indices) return _make_buffer(GL_ELEMENT_ARRAY_BUFFER, indices);
+    return _make_buffer(GL_ELEMENT_ARRAY_BUFFER, vector<unsigned short>(indices.begin(), indices.end()));
+}
+
+// utility to upload faces as triangles, grouping clusters in batches of less than 65536 vertices
+// so that they can use 16-bit indices relative to the batch first vertex
+void _init_faces(Mesh* mesh, MeshBuffers& buffers) {
+    // split quads along their shorter diagonal
+    auto faces = mesh->triangle;
+    for(auto& f : mesh->quad) {
+        if(distSqr(mesh->pos[f.x],mesh->pos[f.z]) <= distSqr(mesh->pos[f.y],mesh->pos[f.w])) {
+            faces.push_back({f.x,f.y,f.z});
+            faces.push_back({f.x,f.z,f.w});
+        } else {
+            faces.push_back({f.y,f.z,f.w});
+            faces.push_back({f.y,f.w,f.x});
+        }
+    }
+    if(faces.empty()) return;
+    // first face and face count of each cluster, or of the whole mesh
+    auto ranges = vector<vec2i>();
+    if(mesh->culling) {
+        for(auto& cluster : mesh->culling->clusters) {
+            if(cluster.triangle_count) ranges.push_back({cluster.triangle_start,cluster.triangle_count});
+            else ranges.push_back({(int)mesh->triangle.size()+2*cluster.quad_start,2*cluster.quad_count});
+        }
+    } else ranges.push_back({0,(int)faces.size()});
+    // group clusters in batches, falling back to 32-bit indices if a cluster alone is too large
+    auto batches = vector<vec2i>();
+    auto cluster_batch = vector<int>();
+    auto short_indices = true;
+    for(auto& r : ranges) {
+        auto vmin = (int)mesh->pos.size(), vmax = 0;
+        for(auto i : range(r.x,r.x+r.y)) for(auto k : range(3)) { vmin = min(vmin,faces[i][k]); vmax = max(vmax,faces[i][k]); }
+        if(vmax - vmin > 65535) short_indices = false;
+        if(batches.empty() or max(vmax,batches.back().y) - min(vmin,batches.back().x) > 65535) batches.push_back({vmin,vmax});
+        else batches.back() = {min(vmin,batches.back().x), max(vmax,batches.back().y)};
+        cluster_batch.push_back(batches.size()-1);
+    }
+    if(not short_indices) {
+        batches = vector<vec2i>(1,vec2i(0,mesh->pos.size()-1));
+        cluster_batch = vector<int>(ranges.size(), 0);
+    }
+    // write indices relative to the batch first vertex
+    auto indices = vector<int>(faces.size()*3);
+    for(auto c : range(ranges.size())) {
+        auto& r = ranges[c];
+        auto base = batches[cluster_batch[c]].x;
+        for(auto i : range(r.x,r.x+r.y)) for(auto k : range(3)) indices[i*3+k] = faces[i][k] - base;
+        buffers.cluster_faces.push_back({cluster_batch[c], r.x*3, r.y*3});
+    }
+    for(auto& batch : batches) buffers.batch_base.push_back(batch.x);
+    buffers.face_type = (short_indices) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    buffers.face_id = _make_index_buffer(indices, short_indices);
+}
+
+// utility to upload hair strands, one after the other so that they are drawn together as line strips,
+// or as triangle strips for ribbons with each vertex twice, on opposite sides; the root texture
+// coordinates are repeated at the strand vertices for textured materials only
+void _init_hair(Mesh* mesh, MeshBuffers& buffers) {
+    auto hair = mesh->hair;
+    auto n = hair->strand_vertices;
+    auto sides = (mesh->mat->hair_width > 0) ? 2 : 1;
+    if(sides == 1) {
+        buffers.hair_pos_id = _make_buffer(GL_ARRAY_BUFFER, hair->pos);
+        buffers.hair_tangent_id = _make_buffer(GL_ARRAY_BUFFER, hair->tangent);
+    } else {
+        auto pos = vector<vec3f>(hair->pos.size()*2), tangent = vector<vec3f>(hair->tangent.size()*2);
+        auto side = vector<float>(hair->pos.size()*2);
+        for(auto i : range(hair->pos.size())) {
+            pos[2*i] = pos[2*i+1] = hair->pos[i];
+            tangent[2*i] = tangent[2*i+1] = hair->tangent[i];
+            side[2*i] = -1; side[2*i+1] = 1;
+        }
+        buffers.hair_pos_id = _make_buffer(GL_ARRAY_BUFFER, pos);
+        buffers.hair_tangent_id = _make_buffer(GL_ARRAY_BUFFER, tangent);
+        buffers.hair_side_id = _make_buffer(GL_ARRAY_BUFFER, side);
+    }
+    if(mesh->mat->kd_txt or mesh->mat->ks_txt or mesh->mat->norm_txt) {
+        auto texcoord = vector<vec2f>(hair->pos.size()*sides);
+        for(auto i : range(texcoord.size())) texcoord[i] = hair->root_texcoord[i / (n*sides)];
+        buffers.hair_texcoord_id = _make_buffer(GL_ARRAY_BUFFER, texcoord);
+    }
+    for(auto s : range(hair->length.size())) {
+        buffers.hair_first.push_back(s*n*sides);
+        buffers.hair_count.push_back(n*sides);
+    }
+}
+
+// initialize the mesh buffers
+void init_meshes(Scene* scene, ShadeState* state) {
+    // instancing needs both instanced draws and per-instance attributes
+    state->gl_instancing = gl_has_extension("GL_ARB_draw_instanced") and gl_has_extension("GL_ARB_instanced_arrays");
+    state->gl_half_float = gl_has_extension("GL_ARB_half_float_vertex");
+    // foreach mesh, and each of its levels of detail
+    auto meshes = vector<Mesh*>();
+    for(auto mesh : get_display_meshes(scene)) {
+        meshes.push_back(mesh);
+        if(mesh->lod) for(auto& level : mesh->lod->levels) meshes.push_back(level.mesh);
+    }
+    for(auto mesh : meshes) {
+        // if already uploaded, skip
+        if(state->gl_mesh_buffers.find(mesh) != state->gl_mesh_buffers.end()) continue;
+        auto& buffers = state->gl_mesh_buffers[mesh];
+        // upload vertex data, compressed if requested (texture coordinates stay floats without half float support),
+        // without normals if shaded flat
+        if(state->gl_compressed) {
+            auto compressed = compress_vertices(mesh);
+            buffers.compressed = true;
+            buffers.pos_offset = compressed.pos_offset;
+            buffers.pos_scale = compressed.pos_scale;
+            buffers.pos_id = _make_buffer(GL_ARRAY_BUFFER, compressed.pos);
+            if(not mesh->flat_shading) buffers.norm_id = _make_buffer(GL_ARRAY_BUFFER, compressed.norm);
+            if(state->gl_half_float) {
+                buffers.texcoord_type = GL_HALF_FLOAT_ARB;
+                buffers.texcoord_id = _make_buffer(GL_ARRAY_BUFFER, compressed.texcoord);
+            } else buffers.texcoord_id = _make_buffer(GL_ARRAY_BUFFER, mesh->texcoord);
+        } else {
+            buffers.pos_id = _make_buffer(GL_ARRAY_BUFFER, mesh->pos);
+            if(not mesh->flat_shading) buffers.norm_id = _make_buffer(GL_ARRAY_BUFFER, mesh->norm);
+            buffers.texcoord_id = _make_buffer(GL_ARRAY_BUFFER, mesh->texcoord);
+        }
+        // upload faces
+        _init_faces(mesh, buffers);
+        // upload lines, turning each spline control polygon into three lines
+        auto short_lines = mesh->pos.size() <= 65536;
+        buffers.line_type = (short_lines) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+        auto lines = vector<int>();
+        for(auto line : mesh->line) { lines.push_back(line.x); lines.push_back(line.y); }
+        for(auto segment : mesh->spline) {
+            for(auto k : range(3)) { lines.push_back(segment[k]); lines.push_back(segment[k+1]); }
+        }
+        buffers.line_id = _make_index_buffer(lines, short_lines);
+        buffers.line_count = lines.size();
+        // upload hair strands
+        if(mesh->hair) _init_hair(mesh, buffers);
+        // upload wireframe edges
+        if(not mesh->triangle.empty() or not mesh->quad.empty()) {
+            auto edges = vector<int>();
+            for(auto edge : EdgeMap(mesh->triangle, mesh->quad).edges()) { edges.push_back(edge.x); edges.push_back(edge.y); }
+            buffers.edge_id = _make_index_buffer(edges, short_lines);
+            buffers.edge_count = edges.size();
+        }
+        // upload instance frames as column-major matrices (updated when instances are culled)
+        if(not mesh->instances.empty()) {
+            auto frames = vector<mat4f>();
+            for(auto& frame : mesh->instances) frames.push_back(transpose(frame_to_matrix(frame)));
+            buffers.instance_id = _make_buffer(GL_ARRAY_BUFFER, frames, GL_DYNAMIC_DRAW);
+            buffers.instance_count = frames.size();
+        }
+    }
+    error_if_glerror();
+}
+
+// utility to add an element range (start, count in indices) merging it with the last one if contiguous
+void _push_range(vector<vec2i>& ranges, int start, int count) {
+    if(not count) return;
+    if(not ranges.empty() and ranges.back().x+ranges.back().y == start) ranges.back().y += count;
+    else ranges.push_back({start,count});
+}
+
+// utility to draw ranges of an element buffer once per instance (no instances for non-instanced meshes)
+// uses one instanced draw call per range if supported, otherwise rebinds mesh_frame for each instance
+void _draw_elements(int mode, unsigned int element_id, int type, const vector<vec2i>& ranges, const vector<frame3f>& instances, ShadeState* state) {
+    if(not element_id) return;
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, element_id);
+    auto size = (type == GL_UNSIGNED_SHORT) ? sizeof(unsigned short) : sizeof(int);
+    for(auto range : ranges) {
+        auto offset = (void*)(size*range.x);
+        if(instances.empty()) {
+            glDrawElements(mode, range.y, type, offset);
+            state->stats.draws++;
+        } else if(state->gl_instancing) {
+            glDrawElementsInstancedARB(mode, range.y, type, offset, instances.size());
+            state->stats.draws++;
+        } else {
+            for(auto& frame : instances) {
+                glUniformMatrix4fv(glGetUniformLocation(state->gl_program_id,"mesh_frame"),
+                                   1,true,&frame_to_matrix(frame)[0][0]);
+                glDrawElements(mode, range.y, type, offset);
+                state->stats.draws++;
+            }
+        }
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// utility to point the vertex attributes to the mesh buffers, starting from vertex base
+// (only the positions if position_only is true); attributes left out of the current shader
+// permutation have no location and are skipped
+void _bind_vertex_pointers(const MeshBuffers& buffers, int base, ShadeState* state, bool position_only = false) {
+    // compressed positions and normals are 16-bit unsigned normalized, decoded in the vertex shader
+    auto pos_size = (buffers.compressed) ? 3*sizeof(unsigned short) : sizeof(vec3f);
+    auto norm_size = (buffers.compressed) ? 2*sizeof(unsigned short) : sizeof(vec3f);
+    auto texcoord_size = (buffers.texcoord_type == GL_FLOAT) ? sizeof(vec2f) : 2*sizeof(unsigned short);
+    auto type = (buffers.compressed) ? GL_UNSIGNED_SHORT : GL_FLOAT;
+    auto vertex_norm_location = glGetAttribLocation(state->gl_program_id, "vertex_norm");
+    auto vertex_texcoord_location = glGetAttribLocation(state->gl_program_id, "vertex_texcoord");
+    glBindBuffer(GL_ARRAY_BUFFER, buffers.pos_id);
+    glVertexAttribPointer(glGetAttribLocation(state->gl_program_id, "vertex_pos"), 3, type, buffers.compressed, 0, (void*)(pos_size*base));
+    if(buffers.norm_id and not position_only and vertex_norm_location >= 0) {
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.norm_id);
+        glVertexAttribPointer(vertex_norm_location, (buffers.compressed) ? 2 : 3, type, buffers.compressed, 0, (void*)(norm_size*base));
+    }
+    if(buffers.texcoord_id and not position_only and vertex_texcoord_location >= 0) {
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.texcoord_id);
+        glVertexAttribPointer(vertex_texcoord_location, 2, buffers.texcoord_type, GL_FALSE, 0, (void*)(texcoord_size*base));
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// utility to upload instance frames to the instance buffer as column-major matrices
+void _upload_instances(MeshBuffers& buffers, const vector<frame3f>& instances) {
+    auto frames = vector<mat4f>();
+    for(auto& frame : instances) frames.push_back(transpose(frame_to_matrix(frame)));
+    glBindBuffer(GL_ARRAY_BUFFER, buffers.instance_id);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, frames.size()*sizeof(mat4f), frames.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    buffers.instance_count = instances.size();
+}
+
+// utility to point the instance frame attribute to the instance buffer if instanced drawing is supported,
+// or set it to the identity; instance frames take four attribute slots, one per matrix column
+// returns whether the attribute reads the instance buffer
+bool _bind_instance_frames(const MeshBuffers& buffers, ShadeState* state) {
+    auto instance_frame_location = glGetAttribLocation(state->gl_program_id, "instance_frame");
+    auto instanced = buffers.instance_id and state->gl_instancing;
+    for(auto i : range(4)) {
+        if(instanced) {
+            glEnableVertexAttribArray(instance_frame_location+i);
+            glBindBuffer(GL_ARRAY_BUFFER, buffers.instance_id);
+            glVertexAttribPointer(instance_frame_location+i, 4, GL_FLOAT, GL_FALSE, sizeof(mat4f), (void*)(sizeof(vec4f)*i));
+            glVertexAttribDivisorARB(instance_frame_location+i, 1);
+        } else glVertexAttrib4f(instance_frame_location+i, i==0, i==1, i==2, i==3);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return instanced;
+}
+
+// utility to stop reading instance frames from the instance buffer
+void _unbind_instance_frames(ShadeState* state) {
+    auto instance_frame_location = glGetAttribLocation(state->gl_program_id, "instance_frame");
+    for(auto i : range(4)) {
+        glVertexAttribDivisorARB(instance_frame_location+i, 0);
+        glDisableVertexAttribArray(instance_frame_location+i);
+    }
+}
+
+// utility to collect the element ranges of the faces of clusters for each batch
+// (all faces if the mesh has no clusters)
+vector<vector<vec2i>> _face_ranges(Mesh* mesh, const MeshBuffers& buffers, const vector<int>& clusters) {
+    auto ranges = vector<vector<vec2i>>(buffers.batch_base.size());
+    auto visible_faces = (mesh->culling) ? clusters : vector<int>();
+    if(not mesh->culling) for(auto c : range(buffers.cluster_faces.size())) visible_faces.push_back(c);
+    for(auto c : visible_faces) {
+        auto& faces = buffers.cluster_faces[c];
+        _push_range(ranges[faces.x], faces.y, faces.z);
+    }
+    return ranges;
+}
+
+// utility to bind the decoding parameters of compressed vertex data and the mesh frame
+void _bind_mesh_uniforms(Mesh* mesh, const MeshBuffers& buffers, ShadeState* state) {
+    glUniform3fv(glGetUniformLocation(state->gl_program_id,"vertex_pos_offset"),
+                 1,&buffers.pos_offset.x);
+    glUniform3fv(glGetUniformLocation(state->gl_program_id,"vertex_pos_scale"),
+                 1,&buffers.pos_scale.x);
+    glUniform1i(glGetUniformLocation(state->gl_program_id,"vertex_norm_octahedral"),
+                buffers.compressed and buffers.norm_id);
+    
+    // bind mesh frame - use frame_to_matrix (instances multiply their frame on top of it)
+    glUniformMatrix4fv(glGetUniformLocation(state->gl_program_id,"mesh_frame"),
+                       1,true,&frame_to_matrix(mesh->instances.empty() ? mesh->frame : identity_frame3f)[0][0]);
+}
+
+// utility to draw the faces of a mesh with the depth-only program, streaming positions only
+void _draw_depth(Mesh* mesh, const MeshBuffers& buffers, const vector<frame3f>& instances,
+                 const vector<vector<vec2i>>& face_ranges, ShadeState* state) {
+    _bind_mesh_uniforms(mesh, buffers, state);
+    auto vertex_pos_location = glGetAttribLocation(state->gl_program_id, "vertex_pos");
+    glEnableVertexAttribArray(vertex_pos_location);
+    auto instanced = _bind_instance_frames(buffers, state);
+    for(auto b : range(buffers.batch_base.size())) {
+        if(face_ranges[b].empty()) continue;
+        _bind_vertex_pointers(buffers, buffers.batch_base[b], state, true);
+        _draw_elements(GL_TRIANGLES, buffers.face_id, buffers.face_type, face_ranges[b], instances, state);
+    }
+    glDisableVertexAttribArray(vertex_pos_location);
+    if(instanced) _unbind_instance_frames(state);
+}
+
 // utility to bind texture parameters for shaders
-// uses texture name, texture_on name, texture pointer and texture unit position
-void _bind_texture(string name_map, string name_on, image3f* txt, int pos, ShadeState* state) {
+// uses texture name, texture pointer and texture unit position
+// (whether a texture is used is compiled in the shader permutation)
+void _bind_texture(string name_map, image3f* txt, int pos, ShadeState* state) {
+    // activate a texture unit at position pos
+    glActiveTexture(GL_TEXTURE0+pos);
     // if txt is not null
     if(txt) {
-        // set texture on boolean parameter to true
-        glUniform1i(glGetUniformLocation(state->gl_program_id,name_on.c_str()),GL_TRUE);
-        // activate a texture unit at position pos
-        glActiveTexture(GL_TEXTURE0+pos);
         // bind texture object to it from state->gl_texture_id map
         glBindTexture(GL_TEXTURE_2D, state->gl_texture_id[txt]);
         // set texture parameter to the position pos
         glUniform1i(glGetUniformLocation(state->gl_program_id, name_map.c_str()), pos);
     } else {
-        // set texture on boolean parameter to false
-        glUniform1i(glGetUniformLocation(state->gl_program_id,name_on.c_str()),GL_FALSE);
-        // activate a texture unit at position pos
-        glActiveTexture(GL_TEXTURE0+pos);
         // set zero as the texture id
         glBindTexture(GL_TEXTURE_2D, 0);
     }
 }
 
-// render the scene with OpenGL
-void shade(Scene* scene, ShadeState* state) {
-    // enable depth test
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LEQUAL);
-    // disable culling face
-    glDisable(GL_CULL_FACE);
-    // let the shader control the points
-    glEnable(GL_POINT_SPRITE);
-    
-    // set up the viewport from the scene image size
-    glViewport(0, 0, scene->image_width, scene->image_height);
+// utility to bind the material coefficients and textures to the current program
+void _bind_material_uniforms(Material* mat, ShadeState* state) {
+    // bind material kd, ks, n
+    glUniform3fv(glGetUniformLocation(state->gl_program_id,"material_kd"),
+                 1,&mat->kd.x);
+    glUniform3fv(glGetUniformLocation(state->gl_program_id,"material_ks"),
+                 1,&mat->ks.x);
+    glUniform1f(glGetUniformLocation(state->gl_program_id,"material_n"),
+                mat->n);
+    // bind texture samplers
+    _bind_texture("material_kd_txt", mat->kd_txt, 0, state);
+    _bind_texture("material_ks_txt", mat->ks_txt, 1, state);
+    _bind_texture("material_norm_txt", mat->norm_txt, 2, state);
+}
+
+// utility to draw the hair strands of a mesh with the current program once per instance (no instances
+// for non-instanced meshes), all strands in one draw call, rebinding mesh_frame for each instance;
+// depth-only programs read positions, tangents and sides only, and attributes left out of the
+// current shader permutation are skipped
+void _draw_hair(Mesh* mesh, const MeshBuffers& buffers, const vector<frame3f>& instances, ShadeState* state, bool depth_only = false) {
+    if(not buffers.hair_pos_id) return;
+    if(not depth_only) _bind_material_uniforms(mesh->mat, state);
+    glUniform1f(glGetUniformLocation(state->gl_program_id,"hair_width"), mesh->mat->hair_width);
+    // hair vertices are not compressed, and are not read with the instance frames
+    _bind_mesh_uniforms(mesh, MeshBuffers(), state);
+    _bind_instance_frames(MeshBuffers(), state);
     
-    // clear the screen (both color and depth) - set cleared color to background
-    glClearColor(scene->background.x, scene->background.y, scene->background.z, 1);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    // enable vertex attributes arrays and point them to the hair buffers, with tangents as normals
+    auto vertex_pos_location = glGetAttribLocation(state->gl_program_id, "vertex_pos");
+    auto vertex_norm_location = glGetAttribLocation(state->gl_program_id, "vertex_norm");
+    auto vertex_texcoord_location = glGetAttribLocation(state->gl_program_id, "vertex_texcoord");
+    auto vertex_side_location = glGetAttribLocation(state->gl_program_id, "vertex_side");
+    auto tangents = vertex_norm_location >= 0;
+    auto sides = buffers.hair_side_id and vertex_side_location >= 0;
+    auto texcoords = buffers.hair_texcoord_id and vertex_texcoord_location >= 0;
+    glEnableVertexAttribArray(vertex_pos_location);
+    glBindBuffer(GL_ARRAY_BUFFER, buffers.hair_pos_id);
+    glVertexAttribPointer(vertex_pos_location, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    if(tangents) {
+        glEnableVertexAttribArray(vertex_norm_location);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.hair_tangent_id);
+        glVertexAttribPointer(vertex_norm_location, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    }
+    if(sides) {
+        glEnableVertexAttribArray(vertex_side_location);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.hair_side_id);
+        glVertexAttribPointer(vertex_side_location, 1, GL_FLOAT, GL_FALSE, 0, 0);
+    }
+    if(texcoords) {
+        glEnableVertexAttribArray(vertex_texcoord_location);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.hair_texcoord_id);
+        glVertexAttribPointer(vertex_texcoord_location, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    } else if(vertex_texcoord_location >= 0) glVertexAttrib2f(vertex_texcoord_location, 0, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
     
-    // enable program
-    glUseProgram(state->gl_program_id);
+    // draw all strands at once
+    auto mode = (mesh->mat->hair_width > 0) ? GL_TRIANGLE_STRIP : GL_LINE_STRIP;
+    if(instances.empty()) {
+        glMultiDrawArrays(mode, buffers.hair_first.data(), buffers.hair_count.data(), buffers.hair_first.size());
+        state->stats.draws++;
+    } else {
+        for(auto& frame : instances) {
+            glUniformMatrix4fv(glGetUniformLocation(state->gl_program_id,"mesh_frame"),
+                               1,true,&frame_to_matrix(frame)[0][0]);
+            glMultiDrawArrays(mode, buffers.hair_first.data(), buffers.hair_count.data(), buffers.hair_first.size());
+            state->stats.draws++;
+        }
+    }
     
+    // disable vertex attribute arrays
+    glDisableVertexAttribArray(vertex_pos_location);
+    if(tangents) glDisableVertexAttribArray(vertex_norm_location);
+    if(sides) glDisableVertexAttribArray(vertex_side_location);
+    if(texcoords) glDisableVertexAttribArray(vertex_texcoord_location);
+}
+
+// utility to bind the camera to the current program
+void _bind_camera_uniforms(Scene* scene, ShadeState* state) {
     // bind camera's position, inverse of frame and projection
     // use frame_to_matrix_inverse and frustum_matrix
     glUniform3fv(glGetUniformLocation(state->gl_program_id,"camera_pos"),
                  1, &scene->camera->frame.o.x);
     glUniformMatrix4fv(glGetUniformLocation(state->gl_program_id,"camera_frame_inverse"),
                        1, true, &frame_to_matrix_inverse(scene->camera->frame)[0][0]);
+    // the image plane window is cut to the tile and shifted by the jitter, converted from pixels to image plane units
+    auto camera = scene->camera;
+    auto size = _tile_size(scene, state);
+    auto x0 = ((state->tile_origin.x + state->jitter.x) / scene->image_width - 0.5f) * camera->width;
+    auto y0 = ((state->tile_origin.y + state->jitter.y) / scene->image_height - 0.5f) * camera->height;
+    auto x1 = x0 + size.x * camera->width / scene->image_width, y1 = y0 + size.y * camera->height / scene->image_height;
     glUniformMatrix4fv(glGetUniformLocation(state->gl_program_id,"camera_projection"),
-                       1, true, &frustum_matrix(-scene->camera->dist*scene->camera->width/2, scene->camera->dist*scene->camera->width/2,
-                                                -scene->camera->dist*scene->camera->height/2, scene->camera->dist*scene->camera->height/2,
-                                                scene->camera->dist,10000)[0][0]);
+                       1, true, &frustum_matrix(camera->dist*x0, camera->dist*x1, camera->dist*y0, camera->dist*y1,
+                                                camera->dist,camera_far)[0][0]);
+}
+
+// utility to bind the camera, ambient and lights to the current program
+void _bind_scene_uniforms(Scene* scene, ShadeState* state) {
+    // bind camera
+    _bind_camera_uniforms(scene, state);
     
-    // bind ambient and number of lights
+    // bind ambient
     glUniform3fv(glGetUniformLocation(state->gl_program_id,"ambient"),1,&scene->ambient.x);
-    glUniform1i(glGetUniformLocation(state->gl_program_id,"lights_num"),scene->lights.size());
+    
+    // bind the shadow atlas (after the material textures)
+    if(_shadows(scene, state)) {
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, state->shadow_texture_id);
+        glUniform1i(glGetUniformLocation(state->gl_program_id,"shadow_atlas"), 3);
+        glUniform1f(glGetUniformLocation(state->gl_program_id,"shadow_atlas_size"), state->shadows.size);
+        glUniform1f(glGetUniformLocation(state->gl_program_id,"shadow_near_ratio"), shadow_near_ratio);
+    }
+    
+    // bind the binned lights textures (after the shadow atlas) and their sizes
+    if(_clustered_lights(scene, state)) {
+        auto& grid = state->lights;
+        auto rows = [](int texels){ return max(1, (texels + light_texture_width-1) / light_texture_width); };
+        unsigned int ids[4] = { state->light_data_id, state->light_clusters_id, state->light_indices_id, state->light_shadows_id };
+        const char* names[4] = { "light_data", "light_clusters", "light_indices", "light_shadows" };
+        for(auto i : range((_shadows(scene, state)) ? 4 : 3)) {
+            glActiveTexture(GL_TEXTURE4+i);
+            glBindTexture(GL_TEXTURE_2D, ids[i]);
+            glUniform1i(glGetUniformLocation(state->gl_program_id,names[i]), 4+i);
+        }
+        glUniform2f(glGetUniformLocation(state->gl_program_id,"light_data_size"), light_texture_width, rows(grid.data.size()));
+        glUniform2f(glGetUniformLocation(state->gl_program_id,"light_shadows_size"), light_texture_width, rows(grid.lights.size()));
+        glUniform2f(glGetUniformLocation(state->gl_program_id,"light_tiles_num"), grid.tiles_x, grid.tiles_y);
+        glUniform2f(glGetUniformLocation(state->gl_program_id,"light_indices_size"), light_texture_width, rows(grid.indices.size()));
+        glUniform1f(glGetUniformLocation(state->gl_program_id,"light_tile_size"), light_tile_size);
+        // the slice of a view distance z is floor(log(z) * scale + bias)
+        auto slice = light_slice_params(grid);
+        glUniform1f(glGetUniformLocation(state->gl_program_id,"light_slices"), grid.slices);
+        glUniform1f(glGetUniformLocation(state->gl_program_id,"light_slice_scale"), slice.x);
+        glUniform1f(glGetUniformLocation(state->gl_program_id,"light_slice_bias"), slice.y);
+        return;
+    }
+    
+    // bind number of lights, the uniform arrays hold at most 16
+    auto lights = vector<Light*>(scene->lights.begin(), scene->lights.begin() + min(16,(int)scene->lights.size()));
+    glUniform1i(glGetUniformLocation(state->gl_program_id,"lights_num"),lights.size());
     
     // foreach light
     auto count = 0;
-    for(auto light : scene->lights) {
+    for(auto light : lights) {
         // bind light position and internsity (create param name with tostring)
         glUniform3fv(glGetUniformLocation(state->gl_program_id,tostring("light_pos[%d]",count).c_str()),
                      1, &light->frame.o.x);
         glUniform3fv(glGetUniformLocation(state->gl_program_id,tostring("light_intensity[%d]",count).c_str()),
                      1, &light->intensity.x);
+        if(_shadows(scene, state)) {
+            auto rect = shadow_rect(state->shadows, light);
+            glUniform4fv(glGetUniformLocation(state->gl_program_id,tostring("light_shadow[%d]",count).c_str()),
+                         1, &rect.x);
+        }
         count++;
     }
+}
+
+// whether depth is laid down before shading (faces only, so not in wireframe)
+bool _depth_prepass(Scene* scene) {
+    return scene->draw_depth_prepass and not scene->draw_wireframe;
+}
+
+// utility to upload the visible instance frames if they differ from the ones in the buffer
+void _update_instances(const MeshVisibility& vis, MeshBuffers& buffers) {
+    auto mesh = vis.mesh;
+    if(not mesh->instances.empty() and
+       (vis.instances.size() != mesh->instances.size() or buffers.instance_count != (int)mesh->instances.size())) {
+        _upload_instances(buffers, vis.instances);
+    }
+}
+
+// utility to bind the view of a shadow map face to the current depth-only program, with the light
+// position as the camera position that hair ribbons face
+void _bind_shadow_view(const ShadowMap& map, const frame3f& frame, ShadeState* state) {
+    auto near = map.radius * shadow_near_ratio;
+    glUniformMatrix4fv(glGetUniformLocation(state->gl_program_id,"camera_projection"),
+                       1, true, &frustum_matrix(-near, near, -near, near, near, map.radius)[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(state->gl_program_id,"camera_frame_inverse"),
+                       1, true, &frame_to_matrix_inverse(frame)[0][0]);
+    glUniform3fv(glGetUniformLocation(state->gl_program_id,"camera_pos"), 1, &map.pos.x);
+}
+
+// render the shadow maps of the lights that moved, or of all lights if the geometry moved,
+// each cube face in its own viewport of the atlas; hair ribbons cast shadows, hair lines do not
+void _render_shadows(Scene* scene, ShadeState* state) {
+    auto& atlas = state->shadows;
+    update_shadow_atlas(scene, &atlas);
+    atlas.faces_rendered = 0;
+    auto dirty = false;
+    for(auto& map : atlas.maps) dirty = dirty or map.dirty;
+    if(not dirty) return;
+    
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, state->shadow_framebuffer_id);
+    auto depth_program_id = get_shader_program(&state->shaders, shader_depth_only);
+    auto meshes = get_display_meshes(scene);
+    auto ribbons = false;
+    for(auto mesh : meshes) ribbons = ribbons or _hair_ribbons(mesh);
+    auto ribbons_program_id = (ribbons) ? get_shader_program(&state->shaders, shader_depth_only | shader_ribbons) : 0;
+    glEnable(GL_SCISSOR_TEST);
+    // slope scaled depth bias against self shadowing
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2, 4);
+    for(auto& map : atlas.maps) {
+        if(not map.dirty) continue;
+        auto near = map.radius * shadow_near_ratio;
+        for(auto face : range(6)) {
+            auto camera = Camera();
+            camera.frame = shadow_face_frame(map.pos, face);
+            camera.width = camera.height = 2*near;
+            camera.dist = near;
+            auto frustum = make_frustum(&camera, map.radius);
+            // faces are laid out in 3 columns and 2 rows
+            auto x = map.origin.x + (face%3)*map.face_size, y = map.origin.y + (face/3)*map.face_size;
+            glViewport(x, y, map.face_size, map.face_size);
+            glScissor(x, y, map.face_size, map.face_size);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            state->gl_program_id = depth_program_id;
+            glUseProgram(state->gl_program_id);
+            _bind_shadow_view(map, camera.frame, state);
+            for(auto mesh : meshes) {
+                if(mesh->instances.empty() and mesh->culling and
+                   not frustum_overlap(frustum, transform_bbox(mesh->frame, mesh->culling->bbox))) continue;
+                auto& buffers = state->gl_mesh_buffers[mesh];
+                if(not buffers.face_id) continue;
+                // shadows are cast by all instances, also the ones outside the view
+                if(buffers.instance_id and buffers.instance_count != (int)mesh->instances.size()) _upload_instances(buffers, mesh->instances);
+                auto clusters = vector<int>();
+                for(auto c : range(buffers.cluster_faces.size())) clusters.push_back(c);
+                _draw_depth(mesh, buffers, mesh->instances, _face_ranges(mesh, buffers, clusters), state);
+            }
+            if(ribbons) {
+                state->gl_program_id = ribbons_program_id;
+                glUseProgram(state->gl_program_id);
+                _bind_shadow_view(map, camera.frame, state);
+                for(auto mesh : meshes) {
+                    if(not _hair_ribbons(mesh)) continue;
+                    if(mesh->instances.empty() and mesh->culling and
+                       not frustum_overlap(frustum, transform_bbox(mesh->frame, mesh->culling->bbox))) continue;
+                    auto& buffers = state->gl_mesh_buffers[mesh];
+                    if(buffers.instance_id and buffers.instance_count != (int)mesh->instances.size()) _upload_instances(buffers, mesh->instances);
+                    _draw_hair(mesh, buffers, mesh->instances, state, true);
+                }
+            }
+            atlas.faces_rendered++;
+        }
+        map.dirty = false;
+    }
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, state->framebuffer_id);
+    state->gl_program_id = 0;
+}
+
+// render the depth of the visible faces only, with the position stream alone and no color writes,
+// then of the visible hair ribbons (hair lines are left out, like line sets)
+void _render_depth_prepass(Scene* scene, const vector<MeshVisibility>& visibility, ShadeState* state) {
+    state->gl_program_id = get_shader_program(&state->shaders, shader_depth_only);
+    glUseProgram(state->gl_program_id);
+    _bind_camera_uniforms(scene, state);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    for(auto& vis : visibility) {
+        auto& buffers = state->gl_mesh_buffers[vis.mesh];
+        if(not buffers.face_id) continue;
+        _update_instances(vis, buffers);
+        _draw_depth(vis.mesh, buffers, vis.instances, _face_ranges(vis.mesh, buffers, vis.clusters), state);
+    }
+    auto ribbons = false;
+    for(auto& vis : visibility) ribbons = ribbons or _hair_ribbons(vis.mesh);
+    if(ribbons) {
+        state->gl_program_id = get_shader_program(&state->shaders, shader_depth_only | shader_ribbons);
+        glUseProgram(state->gl_program_id);
+        _bind_camera_uniforms(scene, state);
+        for(auto& vis : visibility) {
+            if(not _hair_ribbons(vis.mesh)) continue;
+            auto& buffers = state->gl_mesh_buffers[vis.mesh];
+            _update_instances(vis, buffers);
+            _draw_hair(vis.mesh, buffers, vis.instances, state, true);
+        }
+    }
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    state->gl_program_id = 0;
+}
+
+// utility to enable the program for a feature set, binding the scene parameters the first time it is used
+void _use_program(Scene* scene, int features, set<int>& bound_programs, ShadeState* state) {
+    auto program_id = get_shader_program(&state->shaders, features);
+    if(program_id == state->gl_program_id) return;
+    state->gl_program_id = program_id;
+    glUseProgram(program_id);
+    if(not bound_programs.count(program_id)) {
+        _bind_scene_uniforms(scene, state);
+        bound_programs.insert(program_id);
+    }
+}
+
+// render the scene with OpenGL
+void shade(Scene* scene, ShadeState* state) {
+    // enable depth test
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LEQUAL);
+    // disable culling face
+    glDisable(GL_CULL_FACE);
+    // let the shader control the points
+    glEnable(GL_POINT_SPRITE);
+    // multisample if the framebuffer supports it
+    if(scene->draw_msaa) glEnable(GL_MULTISAMPLE);
+    else glDisable(GL_MULTISAMPLE);
+    
+    // render the shadow maps that changed
+    if(_shadows(scene, state)) _render_shadows(scene, state);
+    
+    // set up the viewport from the tile size
+    auto size = _tile_size(scene, state);
+    glViewport(0, 0, size.x, size.y);
+    
+    // clear the screen (both color and depth) - set cleared color to background
+    glClearColor(scene->background.x, scene->background.y, scene->background.z, 1);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    
+    // programs are enabled per material, binding the scene parameters the first time each is used
+    state->gl_program_id = 0;
+    auto bound_programs = set<int>();
+    
+    // find the visible meshes, instances and clusters
+    state->stats = CullingStats();
+    auto visibility = cull_scene(scene, camera_far, &state->occlusion, &state->stats);
     
-    // foreach mesh
-    for(auto mesh : scene->meshes) {
-        // bind material kd, ks, n
-        glUniform3fv(glGetUniformLocation(state->gl_program_id,"material_kd"),
-                     1,&mesh->mat->kd.x);
-        glUniform3fv(glGetUniformLocation(state->gl_program_id,"material_ks"),
-                     1,&mesh->mat->ks.x);
-        glUniform1f(glGetUniformLocation(state->gl_program_id,"material_n"),
-                    mesh->mat->n);
-        glUniform1i(glGetUniformLocation(state->gl_program_id,"material_is_lines"),
-                    mesh->line.size() > 0? 1:0);
-        // bind texture params (txt_on, sampler)
-        _bind_texture("material_kd_txt", "material_kd_txt_on", mesh->mat->kd_txt, 0, state);
-        _bind_texture("material_ks_txt", "material_ks_txt_on", mesh->mat->ks_txt, 1, state);
-        _bind_texture("material_norm_txt", "material_norm_txt_on", mesh->mat->norm_txt, 2, state);
+    // bin the lights over the view clusters
+    if(_clustered_lights(scene, state)) _update_lights(scene, state);
+    
+    // draw front to back, so that hidden fragments fail the depth test early
+    sort_front_to_back(visibility, scene->camera);
+    
+    // lay down the depth of the visible faces, then shade only the fragments matching it
+    auto prepass = _depth_prepass(scene);
+    if(prepass) {
+        _render_depth_prepass(scene, visibility, state);
+        glDepthFunc(GL_EQUAL);
+        glDepthMask(GL_FALSE);
+    }
+    
+    // count the fragments shaded to measure overdraw
+    if(not state->fragments_query_id) glGenQueries(1, &state->fragments_query_id);
+    glBeginQuery(GL_SAMPLES_PASSED, state->fragments_query_id);
+    
+    // foreach visible mesh
+    for(auto& vis : visibility) {
+        auto mesh = vis.mesh;
+        auto& buffers = state->gl_mesh_buffers[mesh];
+        
+        // enable the program compiled for the material features
+        _use_program(scene, _mesh_features(scene, mesh, state), bound_programs, state);
+        auto& instances = vis.instances;
+        
+        // upload the visible instance frames if they differ from the ones in the buffer
+        _update_instances(vis, buffers);
         
-        // bind mesh frame - use frame_to_matrix
-        glUniformMatrix4fv(glGetUniformLocation(state->gl_program_id,"mesh_frame"),
-                           1,true,&frame_to_matrix(mesh->frame)[0][0]);
+        // collect visible face ranges for each batch
+        auto face_ranges = _face_ranges(mesh, buffers, vis.clusters);
+        for(auto& ranges : face_ranges) {
+            for(auto& r : ranges) state->stats.triangles += r.y/3 * max(1,(int)instances.size());
+        }
+        auto edge_ranges = vector<vec2i>(), line_ranges = vector<vec2i>();
+        _push_range(edge_ranges, 0, buffers.edge_count);
+        _push_range(line_ranges, 0, buffers.line_count);
+        
+        // bind material kd, ks, n and textures
+        _bind_material_uniforms(mesh->mat, state);
+        
+        // bind the decoding parameters of compressed vertex data and the mesh frame
+        _bind_mesh_uniforms(mesh, buffers, state);
     
-        // enable vertex attributes arrays and set up pointers to the mesh data
+        // enable vertex attributes arrays and set up pointers to the mesh buffers (normals are left out
+        // of the flat shading permutation and texture coordinates of the untextured ones)
         auto vertex_pos_location = glGetAttribLocation(state->gl_program_id, "vertex_pos");
         auto vertex_norm_location = glGetAttribLocation(state->gl_program_id, "vertex_norm");
-        glEnableVertexAttribArray(vertex_pos_location);
-        glVertexAttribPointer(vertex_pos_location, 3, GL_FLOAT, GL_FALSE, 0, &mesh->pos[0].x);
         auto vertex_texcoord_location = glGetAttribLocation(state->gl_program_id, "vertex_texcoord");
-        if(not mesh->norm.empty()) {
-            glEnableVertexAttribArray(vertex_norm_location);
-            glVertexAttribPointer(vertex_norm_location, 3, GL_FLOAT, GL_FALSE, 0, &mesh->norm[0].x);
-        } else glVertexAttrib3f(vertex_norm_location, 0, 0, 1);
-        if(not mesh->texcoord.empty()) {
-            glEnableVertexAttribArray(vertex_texcoord_location);
-            glVertexAttribPointer(vertex_texcoord_location, 2, GL_FLOAT, GL_FALSE, 0, &mesh->texcoord[0].x);
-        }
-        else glVertexAttrib2f(vertex_texcoord_location, 0, 0);
+        auto norms = buffers.norm_id and vertex_norm_location >= 0;
+        auto texcoords = buffers.texcoord_id and vertex_texcoord_location >= 0;
+        glEnableVertexAttribArray(vertex_pos_location);
+        if(norms) glEnableVertexAttribArray(vertex_norm_location);
+        else if(vertex_norm_location >= 0) glVertexAttrib3f(vertex_norm_location, 0, 0, 1);
+        if(texcoords) glEnableVertexAttribArray(vertex_texcoord_location);
+        else if(vertex_texcoord_location >= 0) glVertexAttrib2f(vertex_texcoord_location, 0, 0);
+        auto instanced = _bind_instance_frames(buffers, state);
         
-        // draw triangles and quads
+        // draw faces one batch at a time, with the vertex attributes starting at the batch first vertex
         if(not scene->draw_wireframe) {
-            if(mesh->triangle.size()) glDrawElements(GL_TRIANGLES, mesh->triangle.size()*3, GL_UNSIGNED_INT, &mesh->triangle[0].x);
-            if(mesh->quad.size()) glDrawElements(GL_QUADS, mesh->quad.size()*4, GL_UNSIGNED_INT, &mesh->quad[0].x);
-        } else {
-            auto edges = EdgeMap(mesh->triangle, mesh->quad).edges();
-            glDrawElements(GL_LINES, edges.size()*2, GL_UNSIGNED_INT, &edges[0].x);
+            for(auto b : range(buffers.batch_base.size())) {
+                if(face_ranges[b].empty()) continue;
+                _bind_vertex_pointers(buffers, buffers.batch_base[b], state);
+                _draw_elements(GL_TRIANGLES, buffers.face_id, buffers.face_type, face_ranges[b], instances, state);
+            }
         }
+        _bind_vertex_pointers(buffers, 0, state);
+        if(scene->draw_wireframe) _draw_elements(GL_LINES, buffers.edge_id, buffers.line_type, edge_ranges, instances, state);
         
-        // draw line sets
-        if(not mesh->line.empty()) glDrawElements(GL_LINES, mesh->line.size()*2, GL_UNSIGNED_INT, mesh->line.data());
-        for(auto segment : mesh->spline) glDrawElements(GL_LINE_STRIP, 4, GL_UNSIGNED_INT, &segment);
+        // draw line sets (not in the depth pre-pass, so depth tested and written as usual)
+        if(prepass and buffers.line_count) { glDepthFunc(GL_LEQUAL); glDepthMask(GL_TRUE); }
+        _draw_elements(GL_LINES, buffers.line_id, buffers.line_type, line_ranges, instances, state);
+        if(prepass and buffers.line_count) { glDepthFunc(GL_EQUAL); glDepthMask(GL_FALSE); }
         
         // disable vertex attribute arrays
         glDisableVertexAttribArray(vertex_pos_location);
-        if(not mesh->norm.empty()) glDisableVertexAttribArray(vertex_norm_location);
-        if(not mesh->texcoord.empty()) glDisableVertexAttribArray(vertex_texcoord_location);
+        if(norms) glDisableVertexAttribArray(vertex_norm_location);
+        if(texcoords) glDisableVertexAttribArray(vertex_texcoord_location);
+        if(instanced) _unbind_instance_frames(state);
+        
+        // draw hair strands with their own program (depth tested and written like line sets, which
+        // also passes the ribbons already in the depth pre-pass)
+        if(buffers.hair_pos_id) {
+            _use_program(scene, _hair_features(scene, mesh, state), bound_programs, state);
+            if(prepass) { glDepthFunc(GL_LEQUAL); glDepthMask(GL_TRUE); }
+            _draw_hair(mesh, buffers, instances, state);
+            if(prepass) { glDepthFunc(GL_EQUAL); glDepthMask(GL_FALSE); }
+        }
+    }
+    glEndQuery(GL_SAMPLES_PASSED);
+    
+    // restore the depth state (the depth mask also applies to clears)
+    glDepthFunc(GL_LEQUAL);
+    glDepthMask(GL_TRUE);
+}
+
+// initialize an offscreen render target, multisampled if samples is more than one and supported,
+// returning whether its framebuffers are complete
+bool init_render_target(RenderTarget* target, int width, int height, int samples, ShadeState* state) {
+    target->width = width;
+    target->height = height;
+    target->samples = 0;
+    if(samples > 1 and state->gl_multisample_framebuffers) {
+        auto max_samples = 0;
+        glGetIntegerv(GL_MAX_SAMPLES_EXT, &max_samples);
+        target->samples = (max_samples > 1) ? min(samples, max_samples) : 0;
     }
+    auto storage = [&](unsigned int& id, int format, int samples) {
+        glGenRenderbuffersEXT(1, &id);
+        glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, id);
+        if(samples) glRenderbufferStorageMultisampleEXT(GL_RENDERBUFFER_EXT, samples, format, width, height);
+        else glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, format, width, height);
+    };
+    storage(target->color_id, GL_RGBA8, target->samples);
+    storage(target->depth_id, GL_DEPTH_COMPONENT24, target->samples);
+    glGenFramebuffersEXT(1, &target->framebuffer_id);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, target->framebuffer_id);
+    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_RENDERBUFFER_EXT, target->color_id);
+    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT, target->depth_id);
+    auto complete = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) == GL_FRAMEBUFFER_COMPLETE_EXT;
+    if(target->samples) {
+        storage(target->resolve_color_id, GL_RGBA8, 0);
+        glGenFramebuffersEXT(1, &target->resolve_framebuffer_id);
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, target->resolve_framebuffer_id);
+        glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_RENDERBUFFER_EXT, target->resolve_color_id);
+        complete = complete and glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) == GL_FRAMEBUFFER_COMPLETE_EXT;
+    }
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, 0);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+    return complete;
+}
+
+// delete the framebuffers and renderbuffers of a render target
+void clear_render_target(RenderTarget* target) {
+    if(target->framebuffer_id) glDeleteFramebuffersEXT(1, &target->framebuffer_id);
+    if(target->resolve_framebuffer_id) glDeleteFramebuffersEXT(1, &target->resolve_framebuffer_id);
+    if(target->color_id) glDeleteRenderbuffersEXT(1, &target->color_id);
+    if(target->depth_id) glDeleteRenderbuffersEXT(1, &target->depth_id);
+    if(target->resolve_color_id) glDeleteRenderbuffersEXT(1, &target->resolve_color_id);
+    *target = RenderTarget();
+}
+
+// read the bottom left pixels of a render target, resolving its samples first if multisampled,
+// or of the window back buffer if target is null
+void _read_pixels(RenderTarget* target, image3f& image) {
+    if(target and target->samples) {
+        glBindFramebufferEXT(GL_READ_FRAMEBUFFER_EXT, target->framebuffer_id);
+        glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER_EXT, target->resolve_framebuffer_id);
+        glBlitFramebufferEXT(0, 0, image.width(), image.height(), 0, 0, image.width(), image.height(), GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, target->resolve_framebuffer_id);
+    }
+    glReadPixels(0, 0, image.width(), image.height(), GL_RGB, GL_FLOAT, image.data());
+    if(target) glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, target->framebuffer_id);
+}
+
+// render the image at width by height to a png file, offscreen if framebuffer objects are supported
+// (or in the window back buffer otherwise), in tiles of at most capture_tile_size with the camera
+// projection cut to each tile; each row of tiles is streamed to the file as soon as it is rendered,
+// so memory does not grow with the image size.
+// each tile accumulates image_samples^2 frames with the camera projection jittered over a grid of
+// sub-pixel offsets (on top of multisampling); prints the time taken and the root mean square
+// difference from single frames
+void capture_image(Scene* scene, ShadeState* state, const string& filename, int width, int height) {
+    auto start = std::chrono::high_resolution_clock::now();
+    auto n = max(1, scene->image_samples);
+    auto window = vec2i(scene->image_width, scene->image_height);
+    auto tile = vec2i(min(width, capture_tile_size), min(height, capture_tile_size));
+    auto target = RenderTarget();
+    auto offscreen = state->gl_framebuffers and
+        init_render_target(&target, tile.x, tile.y, (scene->draw_msaa) ? n*n : 0, state);
+    if(not offscreen) {
+        if(state->gl_framebuffers) clear_render_target(&target);
+        tile = vec2i(min(tile.x, window.x), min(tile.y, window.y));
+    }
+    auto samples = (offscreen) ? max(1, target.samples) : ((scene->draw_msaa) ? max(1, state->gl_samples) : 1);
+    
+    // render at the capture resolution, so that levels of detail, shadow maps and light tiles follow it
+    state->framebuffer_id = target.framebuffer_id;
+    if(offscreen) glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, state->framebuffer_id);
+    scene->image_width = width;
+    scene->image_height = height;
+    
+    // render rows of tiles from the top, in the order of the png rows
+    auto png = open_png_stream(filename, width, height);
+    auto band = vector<unsigned char>(width*tile.y*3);
+    auto tiles = vec2i((width + tile.x-1) / tile.x, (height + tile.y-1) / tile.y);
+    auto error = 0.0;
+    for(auto ty = tiles.y-1; ty >= 0; ty--) {
+        auto y = ty*tile.y, h = min(tile.y, height-y);
+        for(auto tx : range(tiles.x)) {
+            auto x = tx*tile.x, w = min(tile.x, width-x);
+            state->tile_origin = vec2i(x, y);
+            state->tile_size = vec2i(w, h);
+            auto image = image3f(w, h), frame = image3f(w, h), first = image3f();
+            for(auto j : range(n)) {
+                for(auto i : range(n)) {
+                    state->jitter = vec2f((i+0.5f)/n-0.5f, (j+0.5f)/n-0.5f);
+                    shade(scene, state);
+                    _read_pixels((offscreen) ? &target : nullptr, frame);
+                    if(not first.width()) first = frame;
+                    for(auto k : range(w*h)) image.data()[k] += frame.data()[k];
+                }
+            }
+            // average the frames and copy the tile to the band, flipping its rows
+            for(auto r : range(h)) {
+                for(auto c : range(w)) {
+                    auto color = image.at(c, r) / (float)(n*n);
+                    error += lengthSqr(color - first.at(c, r)) / 3;
+                    auto pixel = &band[((h-1-r)*width + x+c)*3];
+                    for(auto k : range(3)) pixel[k] = (unsigned char)clamp(color[k] * 255, 0.0f, 255.0f);
+                }
+            }
+        }
+        write_png_rows(png, band.data(), h);
+    }
+    close_png_stream(png);
+    
+    // back to the window
+    state->jitter = zero2f;
+    state->tile_origin = zero2i;
+    state->tile_size = zero2i;
+    state->framebuffer_id = 0;
+    scene->image_width = window.x;
+    scene->image_height = window.y;
+    if(offscreen) {
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+        clear_render_target(&target);
+    }
+    
+    auto time = std::chrono::duration<float,std::milli>(std::chrono::high_resolution_clock::now()-start).count();
+    message("capture: %dx%d in %d tiles (%s), %d frames of %d msaa samples each in %.1f ms, %.4f rms difference from one frame\n",
+            width, height, tiles.x*tiles.y, (offscreen) ? "offscreen" : "window", n*n, samples, time,
+            sqrt(error / ((double)width*height)));
+}
+
+// print the fragments shaded in the last frame, waiting for the query to finish
+void print_fragments(Scene* scene, ShadeState* state) {
+    auto fragments = 0u;
+    if(state->fragments_query_id) glGetQueryObjectuiv(state->fragments_query_id, GL_QUERY_RESULT, &fragments);
+    message("fragments shaded: %u, %.2f per pixel (depth pre-pass %s)\n", fragments,
+            fragments / (float)(scene->image_width*scene->image_height), (_depth_prepass(scene)) ? "on" : "off");
 }
 
 string scene_filename;          // scene filename
 string image_filename;          // image filename
 Scene* scene;                   // scene arrays
+bool print_stats_next = false;  // print culling statistics after the next frame
+bool upload_compressed = false; // whether to upload compressed vertex data
+int capture_height = 0;         // capture resolution in y (the window resolution if zero)
+bool facet_on_cpu = false;      // whether to duplicate vertices with face normals instead of shading flat meshes with derivatives
+int quit_frames = 0;            // frames rendered before printing the statistics and quitting (zero to run until closed)
 
 // uiloop
 void uiloop() {
@@ -222,7 +1150,8 @@ void uiloop() {
     // setting an error callback
     glfwSetErrorCallback([](int ecode, const char* msg){ return error(msg); });
     
-    // glfwWindowHint(GLFW_SAMPLES, scene->image_samples*scene->image_samples);
+    // multisample with image_samples^2 samples per pixel (the closest supported count is used)
+    if(scene->image_samples > 1) glfwWindowHint(GLFW_SAMPLES, scene->image_samples*scene->image_samples);
 
     auto window = glfwCreateWindow(scene->image_width,
                                    scene->image_height,
@@ -239,6 +1168,33 @@ void uiloop() {
             case 'w':
                 scene->draw_wireframe = not scene->draw_wireframe;
                 break;
+            case 'c':
+                scene->draw_culling = not scene->draw_culling;
+                break;
+            case 'b':
+                scene->draw_backface_culling = not scene->draw_backface_culling;
+                break;
+            case 'l':
+                scene->draw_lod = not scene->draw_lod;
+                break;
+            case 'o':
+                scene->draw_occlusion_culling = not scene->draw_occlusion_culling;
+                break;
+            case 't':
+                scene->draw_clustered_lights = not scene->draw_clustered_lights;
+                break;
+            case 'h':
+                scene->draw_shadows = not scene->draw_shadows;
+                break;
+            case 'z':
+                scene->draw_depth_prepass = not scene->draw_depth_prepass;
+                break;
+            case 'm':
+                scene->draw_msaa = not scene->draw_msaa;
+                break;
+            case 'i':
+                print_stats_next = true;
+                break;
         }
     });
     glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
@@ -249,17 +1205,43 @@ void uiloop() {
 #endif
 
     auto state = new ShadeState();
-    init_shaders(state);
+    state->gl_compressed = upload_compressed;
+    glGetIntegerv(GL_SAMPLES, &state->gl_samples);
+    init_shaders(scene,state);
+    init_shadows(state);
     init_textures(scene,state);
+    init_meshes(scene,state);
     
     auto mouse_last_x = -1.0;
     auto mouse_last_y = -1.0;
+    auto frames = 0;
     
     while(not glfwWindowShouldClose(window)) {
         glfwGetFramebufferSize(window, &scene->image_width, &scene->image_height);
         scene->camera->width = (scene->camera->height * scene->image_width) / scene->image_height;
         
+        if(reload_shaders(&state->shaders)) message("shaders reloaded\n");
+        auto start = std::chrono::high_resolution_clock::now();
         shade(scene,state);
+        
+        // time the last frame of benchmark runs, after the first ones warmed up
+        frames++;
+        if(quit_frames and frames >= quit_frames) {
+            print_stats_next = true;
+            glfwSetWindowShouldClose(window, GL_TRUE);
+        }
+        
+        if(print_stats_next) {
+            // wait for the frame to finish to time it
+            glFinish();
+            auto time = std::chrono::duration<float,std::milli>(std::chrono::high_resolution_clock::now()-start).count();
+            message("frame: %.2f ms, %d msaa samples\n", time, (scene->draw_msaa) ? max(1,state->gl_samples) : 1);
+            print_stats(state->stats);
+            print_fragments(scene, state);
+            if(_clustered_lights(scene, state)) print_stats(state->lights);
+            if(_shadows(scene, state)) message("shadow maps: %d, faces rendered: %d\n", (int)state->shadows.maps.size(), state->shadows.faces_rendered);
+            print_stats_next = false;
+        }
 
         if(glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT)) {
             double x, y;
@@ -274,9 +1256,9 @@ void uiloop() {
         } else { mouse_last_x = -1; mouse_last_y = -1; }
         
         if(scene->draw_captureimage) {
-            auto image = image3f(scene->image_width,scene->image_height);
-            glReadPixels(0, 0, scene->image_width, scene->image_height, GL_RGB, GL_FLOAT, &image.at(0,0));
-            write_png(image_filename, image, true);
+            auto height = (capture_height > 0) ? capture_height : scene->image_height;
+            auto width = (capture_height > 0) ? (int)round(scene->camera->width * height / scene->camera->height) : scene->image_width;
+            capture_image(scene, state, image_filename, width, height);
             scene->draw_captureimage = false;
         }
         
@@ -295,7 +1277,16 @@ void uiloop() {
 int main(int argc, char** argv) {
     auto args = parse_cmdline(argc, argv,
         { "02_model", "raytrace a scene",
-            {  {"resolution", "r", "image resolution", "int", true, jsonvalue() }  },
+            {  {"resolution", "r", "image resolution", "int", true, jsonvalue() },
+               {"stats", "s", "print mesh optimization and culling statistics", "bool", true, jsonvalue(false) },
+               {"compress", "c", "upload compressed vertex data", "bool", true, jsonvalue(false) },
+               {"lights", "l", "add random point lights (for benchmarking)", "int", true, jsonvalue(0) },
+               {"capture", "p", "capture resolution (image height, rendered offscreen in tiles, may exceed the window)", "int", true, jsonvalue(0) },
+               {"facets", "f", "duplicate vertices of faceted meshes with face normals instead of deriving them in the shader", "bool", true, jsonvalue(false) },
+               {"bezier", "b", "bezier flatness tolerance on screen (pixels), subdividing splines adaptively if positive", "float", true, jsonvalue(0) },
+               {"evaluate", "e", "tessellate bezier splines by evaluating them instead of splitting", "bool", true, jsonvalue(false) },
+               {"hair", "a", "grow hair strands on each hairy mesh (for benchmarking)", "int", true, jsonvalue(0) },
+               {"quit", "q", "render this many frames, print the statistics of the last and quit (for benchmarking)", "int", true, jsonvalue(0) }  },
             {  {"scene_filename", "", "scene filename", "string", false, jsonvalue("scene.json")},
                {"image_filename", "", "image filename", "string", true, jsonvalue("")}  }
         });
@@ -303,12 +1294,38 @@ int main(int argc, char** argv) {
     image_filename = (args.object_element("image_filename").as_string() != "") ?
         args.object_element("image_filename").as_string() :
         scene_filename.substr(0,scene_filename.size()-5)+".png";
+    print_stats_next = args.object_element("stats").as_bool();
+    upload_compressed = args.object_element("compress").as_bool();
+    capture_height = args.object_element("capture").as_int();
+    facet_on_cpu = args.object_element("facets").as_bool();
+    quit_frames = args.object_element("quit").as_int();
     scene = load_json_scene(scene_filename);
     if(not args.object_element("resolution").is_null()) {
         scene->image_height = args.object_element("resolution").as_int();
         scene->image_width = scene->camera->width * scene->image_height / scene->camera->height;
     }
+    add_random_lights(scene, args.object_element("lights").as_int());
+    if(args.object_element("bezier").as_float() > 0) scene->subdivision_bezier_pixels = args.object_element("bezier").as_float();
+    if(args.object_element("evaluate").as_bool()) scene->subdivision_bezier_evaluate = true;
+    if(args.object_element("hair").as_int() > 0) {
+        for(auto mesh : scene->meshes) if(mesh->mat->hair_count) mesh->mat->hair_count = args.object_element("hair").as_int();
+    }
+    auto start = std::chrono::high_resolution_clock::now();
     subdivide(scene);
+    if(print_stats_next) {
+        auto time = std::chrono::duration<float,std::milli>(std::chrono::high_resolution_clock::now()-start).count();
+        auto lines = 0;
+        for(auto mesh : scene->meshes) {
+            lines += mesh->line.size();
+            if(mesh->hair) lines += mesh->hair->length.size() * (mesh->hair->strand_vertices-1);
+        }
+        message("subdivision: %.1f ms, %d lines (%.1f M lines/s)\n", time, lines, lines / (time * 1000));
+    }
+    if(facet_on_cpu) for(auto mesh : scene->meshes) if(mesh->flat_shading) facet_normals(mesh);
+    make_lods(scene);
+    compute_bounds(scene);
+    optimize_meshes(scene, print_stats_next);
+    if(print_stats_next and upload_compressed) print_compression_report(scene);
     uiloop();
 }
 
@@ -8,70 +8,184 @@ uniform vec3 camera_pos;            // camera position (center of the camera fra
 
 uniform vec3 ambient;               // scene ambient
 
+// lights are either read from the lists of the view cluster of the fragment (CLUSTERED_LIGHTS),
+// stored in float textures in rows indexed as i = x + y * width, or passed as uniform arrays
+#ifdef CLUSTERED_LIGHTS
+uniform mat4 camera_frame_inverse;  // inverse of the camera frame (as a matrix)
+
+uniform sampler2D light_data;       // two texels per light: position and radius, intensity
+uniform sampler2D light_clusters;   // first light index (luminance) and light count (alpha) of each cluster,
+                                    // with a tiles_x by tiles_y block per slice
+uniform sampler2D light_indices;    // light indices of all clusters
+uniform vec2 light_data_size;       // light data texture size
+uniform vec2 light_tiles_num;       // number of tiles in x and y
+uniform vec2 light_indices_size;    // light indices texture size
+uniform float light_tile_size;      // tile size in pixels
+uniform float light_slices;         // number of depth slices
+uniform float light_slice_scale;    // slice of a view distance z is floor(log(z) * scale + bias)
+uniform float light_slice_bias;
+#ifdef SHADOWS
+uniform sampler2D light_shadows;    // shadow map of each light, as light_shadow below
+uniform vec2 light_shadows_size;    // light shadows texture size
+#endif
+#else
 uniform int lights_num;             // number of lights
 uniform vec3 light_pos[16];         // light positions
 uniform vec3 light_intensity[16];   // light intensities
+#ifdef SHADOWS
+uniform vec4 light_shadow[16];      // light shadow maps: block origin and face size in the atlas, far distance
+                                    // (negative face size if the light has no shadow map)
+#endif
+#endif
+
+// lights with shadow maps are shadowed (SHADOWS), their six cube faces packed in a depth atlas
+#ifdef SHADOWS
+uniform sampler2DShadow shadow_atlas;   // shadow maps atlas
+uniform float shadow_atlas_size;    // atlas resolution
+uniform float shadow_near_ratio;    // near distance of the cube faces as a fraction of their far distance
+#endif
 
 uniform vec3 material_kd;           // material kd
 uniform vec3 material_ks;           // material ks
 uniform float material_n;           // material n
-uniform int material_is_lines;     // whether the material is lines or meshes
 
-uniform bool material_kd_txt_on;    // material kd texture enabled
+// material features are compiled in separate permutations:
+// MATERIAL_KD_TXT, MATERIAL_KS_TXT, MATERIAL_NORM_TXT and MATERIAL_IS_LINES;
+// faceted meshes (FLAT_SHADING) share their vertices and get face normals from position derivatives
+#ifdef MATERIAL_KD_TXT
 uniform sampler2D material_kd_txt;  // material kd texture
-uniform bool material_ks_txt_on;    // material ks texture enabled
+#endif
+#ifdef MATERIAL_KS_TXT
 uniform sampler2D material_ks_txt;  // material ks texture
-uniform bool material_norm_txt_on;    // material norm texture enabled
+#endif
+#ifdef MATERIAL_NORM_TXT
 uniform sampler2D material_norm_txt;  // material norm texture
+#endif
+
+#ifdef CLUSTERED_LIGHTS
+// lookup the texel i of a texture stored in rows
+vec4 texel(sampler2D txt, vec2 size, float i) {
+    vec2 xy = vec2(mod(i, size.x), floor(i / size.x));
+    return texture2D(txt, (xy+0.5)/size);
+}
+#endif
+
+#ifdef SHADOWS
+// fraction of a light reaching pos, from the cube face of its shadow map facing pos
+float shadow(vec3 lpos, vec4 map) {
+    if(map.z <= 0.0) return 1.0;
+    // face axis and up direction, faces are +x, -x, +y, -y, +z, -z with y as up except for y that uses z
+    vec3 v = pos - lpos;
+    vec3 a = abs(v);
+    vec3 d, up;
+    float face;
+    if(a.x >= a.y && a.x >= a.z) { face = (v.x >= 0.0) ? 0.0 : 1.0; d = vec3(1.0-2.0*face,0,0); up = vec3(0,1,0); }
+    else if(a.y >= a.z) { face = (v.y >= 0.0) ? 2.0 : 3.0; d = vec3(0,5.0-2.0*face,0); up = vec3(0,0,1); }
+    else { face = (v.z >= 0.0) ? 4.0 : 5.0; d = vec3(0,0,9.0-2.0*face); up = vec3(0,1,0); }
+    // face coordinates, kept half a texel inside so that filtering does not read the next face
+    float dist = dot(v, d);
+    vec2 uv = vec2(dot(v, cross(up, -d)), dot(v, up)) / dist * 0.5 + 0.5;
+    float margin = 0.5 / (map.z * shadow_atlas_size);
+    uv = clamp(uv, margin, 1.0-margin);
+    // faces are laid out in 3 columns and 2 rows
+    vec2 st = map.xy + (vec2(mod(face, 3.0), floor(face / 3.0)) + uv) * map.z;
+    // window depth of the distance along the face axis, as written by the face projection
+    float f = map.w, n = map.w * shadow_near_ratio;
+    float depth = ((f+n)/(f-n) - 2.0*f*n/((f-n)*dist)) * 0.5 + 0.5;
+    return shadow2D(shadow_atlas, vec3(st, min(depth, 1.0))).r;
+}
+#endif
+
+// blinn-phong shading of a point light
+vec3 shade_light(vec3 lpos, vec3 lintensity, vec3 n, vec3 camdir, vec3 kd, vec3 ks) {
+    // compute point light color at pos
+    vec3 lightIntensity = lintensity / pow(distance(lpos, pos),2);
+    
+    // compute light direction at pos
+    vec3 ldir = normalize(lpos-pos);
+    // compute view direction using camera_pos and pos
+
+    // compute h
+    vec3 bisector = normalize(ldir+camdir);
+#ifdef MATERIAL_IS_LINES
+    // lines store their tangent in the normal, so use the sine with the tangent
+    float cos_h = sqrt(1- dot(n, bisector)*dot(n, bisector));
+    float cos_l = cos_h;
+#else
+    float cos_h = dot(n, bisector);
+    float cos_l = dot(n, ldir);
+#endif
+    // blinn-phong model
+    return lightIntensity * (kd + ks * max(0, pow(cos_h,material_n))) * max(0, cos_l);
+}
 
 // main
 void main() {
-    // re-normalize normals
+#ifdef DEPTH_ONLY
+    gl_FragColor = vec4(0,0,0,1);
+    return;
+#endif
+    // re-normalize normals, or take the normal of the face plane, spanned by the position derivatives
+#ifdef FLAT_SHADING
+    vec3 n = normalize(cross(dFdx(pos), dFdy(pos)));
+#else
     vec3 n = normalize(norm);
+#endif
     vec3 c = vec3(0,0,0);   // initialize to red to see it well
     vec3 kd, ks;
     // YOUR CODE GOES HERE ---------------------
     vec3 camdir = normalize(camera_pos-pos);
     n = faceforward(n, camdir, -n);
     // compute material values by looking up textures is necessary
-    if(material_kd_txt_on)
-    {
-        vec3 tex = texture2D(material_kd_txt, texcoord).rgb;
-        kd = tex*material_kd;
-    }
-    else
-        kd = material_kd;
-    if(material_ks_txt_on)
-    {
-        vec3 tex = texture2D(material_ks_txt, texcoord).rgb;
-        ks = tex*material_ks;
-    }
-    else
-        ks = material_ks;
+#ifdef MATERIAL_KD_TXT
+    kd = texture2D(material_kd_txt, texcoord).rgb*material_kd;
+#else
+    kd = material_kd;
+#endif
+#ifdef MATERIAL_KS_TXT
+    ks = texture2D(material_ks_txt, texcoord).rgb*material_ks;
+#else
+    ks = material_ks;
+#endif
     // lookup normal map if needed
-    if(material_norm_txt_on)
-    {
-        vec3 tex = texture2D(material_norm_txt, texcoord).xyz;
-        n = normalize(tex*2-1);
-    }
+#ifdef MATERIAL_NORM_TXT
+    n = normalize(texture2D(material_norm_txt, texcoord).xyz*2-1);
+#endif
     // accumulate ambient
     c += ambient*kd;
+#ifdef CLUSTERED_LIGHTS
+    // foreach light of the fragment cluster, from its tile and the slice of its view distance
+    float z = -(camera_frame_inverse * vec4(pos,1)).z;
+    float slice = clamp(floor(log(z) * light_slice_scale + light_slice_bias), 0.0, light_slices-1.0);
+    vec2 tile = floor(gl_FragCoord.xy / light_tile_size) + vec2(0.0, slice * light_tiles_num.y);
+    vec4 cluster = texture2D(light_clusters, (tile+0.5) / vec2(light_tiles_num.x, light_tiles_num.y*light_slices));
+    for(float k = 0.0; k < cluster.a; k += 1.0)
+    {
+        float l = texel(light_indices, light_indices_size, cluster.x + k).x;
+        vec4 lpos = texel(light_data, light_data_size, 2.0*l);
+        vec3 lintensity = texel(light_data, light_data_size, 2.0*l+1.0).rgb;
+        // fade the light to zero at its radius, where its intensity is below the cutoff,
+        // so that clusters it was not binned in do not show a seam
+        float fade = clamp(1.0 - pow(distance(lpos.xyz, pos) / lpos.w, 4.0), 0.0, 1.0);
+#ifdef SHADOWS
+        c += shade_light(lpos.xyz, lintensity * fade * fade, n, camdir, kd, ks) * shadow(lpos.xyz, texel(light_shadows, light_shadows_size, l));
+#else
+        c += shade_light(lpos.xyz, lintensity * fade * fade, n, camdir, kd, ks);
+#endif
+    }
+#else
     // foreach light
     int i;
     for(i = 0; i < lights_num; i++)
     {
-        // compute point light color at pos
-        vec3 lightIntensity = light_intensity[i] / pow(distance(light_pos[i], pos),2);
-        
-        // compute light direction at pos
-        vec3 ldir = normalize(light_pos[i]-pos);
-        // compute view direction using camera_pos and pos
-
-        // compute h
-        vec3 bisector = normalize(ldir+camdir);
         // accumulate blinn-phong model
-        c += (lightIntensity * (kd + ks * max(0, pow((1-material_is_lines)*dot(n, bisector)+material_is_lines*sqrt(1- dot(n, bisector)*dot(n, bisector)),material_n))) * max(0, (1-material_is_lines)*dot(n,ldir) + material_is_lines*sqrt(1- dot(n, bisector)*dot(n, bisector)))); //tangente nella spline
+#ifdef SHADOWS
+        c += shade_light(light_pos[i], light_intensity[i], n, camdir, kd, ks) * shadow(light_pos[i], light_shadow[i]);
+#else
+        c += shade_light(light_pos[i], light_intensity[i], n, camdir, kd, ks);
+#endif
     }
+#endif
     // output final color by setting gl_FragColor
     gl_FragColor = vec4(c,1);
 }
@@ -1,24 +1,63 @@
 #version 120
 
-attribute vec3 vertex_pos;          // vertex position (in mesh coordinate frame)
-attribute vec3 vertex_norm;         // vertex normal   (in mesh coordinate frame)
+attribute vec3 vertex_pos;          // vertex position (in mesh coordinate frame, quantized if compressed)
+attribute vec3 vertex_norm;         // vertex normal   (in mesh coordinate frame, octahedral encoded in xy if compressed)
 attribute vec2 vertex_texcoord;     // vertex texture coordinate
+attribute mat4 instance_frame;      // instance frame (identity if the mesh is not instanced)
+attribute float vertex_side;        // side of hair ribbon vertices across their strand (-1 or 1)
 
+uniform vec3 vertex_pos_offset;     // offset of quantized positions (zero if not compressed)
+uniform vec3 vertex_pos_scale;      // scale of quantized positions (one if not compressed)
+uniform bool vertex_norm_octahedral;// whether normals are octahedral encoded
 uniform mat4 mesh_frame;            // mesh frame (as a matrix)
 uniform mat4 camera_frame_inverse;  // inverse of the camera frame (as a matrix)
 uniform mat4 camera_projection;     // camera projection
+uniform vec3 camera_pos;            // camera position (in world coordinate)
+uniform float hair_width;           // width of hair ribbons (in mesh coordinate frame)
 
 varying vec3 pos;                   // [to fragment shader] vertex position (in world coordinate)
 varying vec3 norm;                  // [to fragment shader] vertex normal (in world coordinate)
 varying vec2 texcoord;              // [to fragment shader] vertex texture coordinate
 
+// positions must match exactly between the depth pre-pass and the shading pass (tested for equality)
+invariant gl_Position;
+
+// decode a normal encoded on an octahedron unfolded in [0,1]^2
+vec3 decode_octahedral(vec2 e) {
+    e = e*2.0-1.0;
+    vec3 n = vec3(e, 1.0-abs(e.x)-abs(e.y));
+    if(n.z < 0.0) n.xy = (1.0-abs(e.yx)) * vec2(e.x >= 0.0 ? 1.0 : -1.0, e.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
+
 // main function
 void main() {
+    // decode compressed vertex data
+    vec3 mesh_pos = vertex_pos_offset + vertex_pos_scale * vertex_pos;
+    // combine the mesh frame with the instance frame
+    mat4 frame = mesh_frame * instance_frame;
+    // depth-only passes (DEPTH_ONLY) stream positions only
+#ifndef DEPTH_ONLY
+    vec3 mesh_norm = (vertex_norm_octahedral) ? decode_octahedral(vertex_norm.xy) : vertex_norm;
     // compute pos and normal in world space and set up variables for fragment shader (use mesh_frame)
-    pos = (mesh_frame * vec4(vertex_pos,1)).xyz / (mesh_frame * vec4(vertex_pos,1)).w;
-    norm = (mesh_frame * vec4(vertex_norm,0)).xyz;
+    pos = (frame * vec4(mesh_pos,1)).xyz / (frame * vec4(mesh_pos,1)).w;
+    norm = (frame * vec4(mesh_norm,0)).xyz;
     // copy texture coordinates down
     texcoord = vertex_texcoord;
+#endif
+#ifdef HAIR_RIBBONS
+    // move hair vertices to their side across the strand tangent (stored uncompressed in the normal)
+    // and the view direction, so that ribbons face the camera (also in depth-only passes)
+    vec4 strand_pos = frame * vec4(mesh_pos,1);
+    vec3 strand_tangent = (frame * vec4(vertex_norm,0)).xyz;
+    vec3 ribbon_pos = strand_pos.xyz / strand_pos.w;
+    ribbon_pos += normalize(cross(strand_tangent, ribbon_pos - camera_pos)) * hair_width * 0.5 * vertex_side;
+#ifndef DEPTH_ONLY
+    pos = ribbon_pos;
+#endif
+    gl_Position = camera_projection * camera_frame_inverse * vec4(ribbon_pos,1);
+#else
     // project vertex position to gl_Position using mesh_frame, camera_frame_inverse and camera_projection
-    gl_Position = camera_projection * camera_frame_inverse * mesh_frame * vec4(vertex_pos,1);
+    gl_Position = camera_projection * camera_frame_inverse * frame * vec4(mesh_pos,1);
+#endif
 }
@@ -0,0 +1,207 @@
+#include "optimize.h"
+
+#include <algorithm>
+
+// accumulate the cache misses of a list of faces in a FIFO cache
+template<typename T>
+int _fifo_misses(const vector<T>& faces, int n, vector<int>& cache, int cache_size) {
+    auto misses = 0;
+    for(auto& f : faces) {
+        for(auto k : range(n)) {
+            if(std::find(cache.begin(), cache.end(), f[k]) != cache.end()) continue;
+            misses++;
+            cache.push_back(f[k]);
+            if((int)cache.size() > cache_size) cache.erase(cache.begin());
+        }
+    }
+    return misses;
+}
+
+float compute_acmr(Mesh* mesh, int cache_size) {
+    auto triangles = mesh->triangle.size() + 2*mesh->quad.size();
+    if(not triangles) return 0;
+    auto cache = vector<int>();
+    auto misses = _fifo_misses(mesh->triangle, 3, cache, cache_size) + _fifo_misses(mesh->quad, 4, cache, cache_size);
+    return misses / (float)triangles;
+}
+
+// score of a vertex for the face ordering, given its LRU cache position (-1 if not cached)
+// and the number of faces still to emit that use it
+float _forsyth_score(int cache_pos, int valence, int n) {
+    if(valence == 0) return -1;
+    auto score = 0.0f;
+    if(cache_pos >= 0) {
+        // vertices of the last face get a fixed score, so that the next face does not just repeat them
+        if(cache_pos < n) score = 0.75f;
+        else score = pow(1 - (cache_pos-n) / (float)(optimize_cache_size-n), 1.5f);
+    }
+    // boost vertices with few faces left, so that they are finished off
+    return score + 2 * pow((float)valence, -0.5f);
+}
+
+// reorder a range of faces greedily, picking the face whose vertices score highest in an LRU cache;
+// local must map all vertices to -1 and is restored on return
+template<typename T>
+void _forsyth_sort(vector<T>& faces, int start, int count, int n, vector<int>& local) {
+    if(count < 2) return;
+    // local vertex ids and the faces using each vertex
+    auto verts = vector<int>();
+    for(auto i : range(start, start+count)) {
+        for(auto k : range(n)) {
+            auto v = faces[i][k];
+            if(local[v] < 0) { local[v] = verts.size(); verts.push_back(v); }
+        }
+    }
+    auto vfaces = vector<vector<int>>(verts.size());
+    for(auto i : range(count)) for(auto k : range(n)) vfaces[local[faces[start+i][k]]].push_back(i);
+    auto cache_pos = vector<int>(verts.size(), -1);
+    auto score = vector<float>(verts.size());
+    for(auto j : range(verts.size())) score[j] = _forsyth_score(-1, vfaces[j].size(), n);
+    auto face_score = vector<float>(count, 0);
+    auto best = 0;
+    for(auto i : range(count)) {
+        for(auto k : range(n)) face_score[i] += score[local[faces[start+i][k]]];
+        if(face_score[i] > face_score[best]) best = i;
+    }
+
+    auto emitted = vector<bool>(count, false);
+    auto order = vector<int>();
+    auto cache = vector<int>();
+    auto cursor = 0;
+    while((int)order.size() < count) {
+        // restart from the first face left when no cached vertex has faces left
+        if(best < 0) {
+            while(emitted[cursor]) cursor++;
+            best = cursor;
+        }
+        emitted[best] = true;
+        order.push_back(best);
+        // move the face vertices to the front of the cache
+        auto touched = vector<int>();
+        for(auto k : range(n)) {
+            auto j = local[faces[start+best][k]];
+            auto& vf = vfaces[j];
+            vf.erase(std::remove(vf.begin(), vf.end(), best), vf.end());
+            if(std::find(touched.begin(), touched.end(), j) == touched.end()) touched.push_back(j);
+        }
+        for(auto j : cache) if(std::find(touched.begin(), touched.end(), j) == touched.end()) touched.push_back(j);
+        for(auto i : range(touched.size())) cache_pos[touched[i]] = (i < optimize_cache_size) ? i : -1;
+        cache.assign(touched.begin(), touched.begin()+min((int)touched.size(), optimize_cache_size));
+        // rescore the cached and evicted vertices and their faces, picking the best one next
+        for(auto j : touched) score[j] = _forsyth_score(cache_pos[j], vfaces[j].size(), n);
+        best = -1;
+        for(auto j : touched) {
+            for(auto i : vfaces[j]) {
+                face_score[i] = 0;
+                for(auto k : range(n)) face_score[i] += score[local[faces[start+i][k]]];
+                if(best < 0 or face_score[i] > face_score[best]) best = i;
+            }
+        }
+    }
+
+    auto sorted = vector<T>(count);
+    for(auto i : range(count)) sorted[i] = faces[start+order[i]];
+    std::copy(sorted.begin(), sorted.end(), faces.begin()+start);
+    for(auto v : verts) local[v] = -1;
+}
+
+void optimize_vertex_cache(Mesh* mesh) {
+    auto local = vector<int>(mesh->pos.size(), -1);
+    if(not mesh->culling) {
+        _forsyth_sort(mesh->triangle, 0, mesh->triangle.size(), 3, local);
+        _forsyth_sort(mesh->quad, 0, mesh->quad.size(), 4, local);
+        return;
+    }
+    // faces are reordered only within clusters, so that cluster ranges stay valid
+    for(auto& cluster : mesh->culling->clusters) {
+        _forsyth_sort(mesh->triangle, cluster.triangle_start, cluster.triangle_count, 3, local);
+        _forsyth_sort(mesh->quad, cluster.quad_start, cluster.quad_count, 4, local);
+    }
+}
+
+void optimize_overdraw(Mesh* mesh) {
+    if(not mesh->culling or mesh->culling->clusters.size() < 2) return;
+    auto& clusters = mesh->culling->clusters;
+    // clusters pointing outwards from the mesh center are more likely to hide the ones behind them
+    auto mesh_center = center(mesh->culling->bbox);
+    auto outward = [&](const MeshCulling::Cluster& cluster) {
+        return dot(center(cluster.bbox)-mesh_center, cluster.cone_axis);
+    };
+    // triangle clusters stay ahead of quad clusters, as they are drawn separately
+    std::stable_sort(clusters.begin(), clusters.end(), [&](const MeshCulling::Cluster& a, const MeshCulling::Cluster& b) {
+        if((a.quad_count > 0) != (b.quad_count > 0)) return a.quad_count == 0;
+        return outward(a) > outward(b);
+    });
+    // move faces to follow the new cluster order
+    auto triangle = vector<vec3i>();
+    auto quad = vector<vec4i>();
+    for(auto& cluster : clusters) {
+        auto triangle_start = (int)triangle.size(), quad_start = (int)quad.size();
+        triangle.insert(triangle.end(), mesh->triangle.begin()+cluster.triangle_start,
+                        mesh->triangle.begin()+cluster.triangle_start+cluster.triangle_count);
+        quad.insert(quad.end(), mesh->quad.begin()+cluster.quad_start,
+                    mesh->quad.begin()+cluster.quad_start+cluster.quad_count);
+        cluster.triangle_start = triangle_start;
+        cluster.quad_start = quad_start;
+    }
+    mesh->triangle = triangle;
+    mesh->quad = quad;
+}
+
+void optimize_vertex_fetch(Mesh* mesh) {
+    // skinning and simulation keep more per-vertex data
+    if(mesh->skinning or mesh->simulation) return;
+    // only per-vertex attributes can be permuted, shorter ones (like the texture coordinates left
+    // behind by catmull-clark subdivision) cannot be indexed by vertex and are dropped
+    if(mesh->norm.size() != mesh->pos.size()) mesh->norm.clear();
+    if(mesh->texcoord.size() != mesh->pos.size()) mesh->texcoord.clear();
+    // number vertices by first use, leaving unused ones at the end
+    auto remap = vector<int>(mesh->pos.size(), -1);
+    auto order = vector<int>();
+    auto use = [&](int v) {
+        if(remap[v] >= 0) return;
+        remap[v] = order.size();
+        order.push_back(v);
+    };
+    for(auto& f : mesh->triangle) for(auto k : range(3)) use(f[k]);
+    for(auto& f : mesh->quad) for(auto k : range(4)) use(f[k]);
+    for(auto& f : mesh->point) use(f);
+    for(auto& f : mesh->line) for(auto k : range(2)) use(f[k]);
+    for(auto& f : mesh->spline) for(auto k : range(4)) use(f[k]);
+    for(auto v : range(mesh->pos.size())) use(v);
+    // permute vertex data and rewrite indices
+    auto pos = mesh->pos;
+    for(auto i : range(order.size())) mesh->pos[i] = pos[order[i]];
+    if(not mesh->norm.empty()) {
+        auto norm = mesh->norm;
+        for(auto i : range(order.size())) mesh->norm[i] = norm[order[i]];
+    }
+    if(not mesh->texcoord.empty()) {
+        auto texcoord = mesh->texcoord;
+        for(auto i : range(order.size())) mesh->texcoord[i] = texcoord[order[i]];
+    }
+    for(auto& f : mesh->triangle) for(auto k : range(3)) f[k] = remap[f[k]];
+    for(auto& f : mesh->quad) for(auto k : range(4)) f[k] = remap[f[k]];
+    for(auto& f : mesh->point) f = remap[f];
+    for(auto& f : mesh->line) for(auto k : range(2)) f[k] = remap[f[k]];
+    for(auto& f : mesh->spline) for(auto k : range(4)) f[k] = remap[f[k]];
+}
+
+void optimize_meshes(Scene* scene, bool verbose) {
+    auto count = 0;
+    for(auto mesh : get_display_meshes(scene)) {
+        auto meshes = vector<Mesh*>(1,mesh);
+        if(mesh->lod) for(auto& level : mesh->lod->levels) meshes.push_back(level.mesh);
+        for(auto i : range(meshes.size())) {
+            auto m = meshes[i];
+            auto before = compute_acmr(m);
+            optimize_vertex_cache(m);
+            optimize_overdraw(m);
+            optimize_vertex_fetch(m);
+            if(verbose and (m->triangle.size() or m->quad.size()))
+                message("mesh %d lod %d: %d triangles %d quads, acmr %.3f -> %.3f\n",
+                        count, i, (int)m->triangle.size(), (int)m->quad.size(), before, compute_acmr(m));
+        }
+        count++;
+    }
+}
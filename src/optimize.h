@@ -0,0 +1,29 @@
+#ifndef _OPTIMIZE_H_
+#define _OPTIMIZE_H_
+
+#include "scene.h"
+
+// size of the FIFO post-transform cache simulated to measure the cache miss ratio
+const int optimize_fifo_size = 16;
+
+// size of the LRU cache modeled when reordering faces
+const int optimize_cache_size = 32;
+
+// average cache miss ratio: vertices transformed per triangle with a FIFO post-transform cache
+// (quads count as two triangles)
+float compute_acmr(Mesh* mesh, int cache_size = optimize_fifo_size);
+
+// reorder the faces of each cluster for the post-transform vertex cache
+void optimize_vertex_cache(Mesh* mesh);
+
+// reorder clusters so that the ones facing away from the mesh center, which tend to hide the others, come first
+void optimize_overdraw(Mesh* mesh);
+
+// renumber vertices in the order the faces use them
+void optimize_vertex_fetch(Mesh* mesh);
+
+// optimize the display meshes and their levels of detail (after their clusters are computed),
+// printing the cache miss ratio before and after if verbose
+void optimize_meshes(Scene* scene, bool verbose);
+
+#endif
@@ -0,0 +1,86 @@
+#include "sampling.h"
+
+// area of the triangle (a,b,c)
+float _triangle_area(const vec3f& a, const vec3f& b, const vec3f& c) {
+    return length(cross(b-a,c-a))/2;
+}
+
+SurfaceSampler make_surface_sampler(Mesh* mesh) {
+    auto sampler = SurfaceSampler();
+    sampler.mesh = mesh;
+    // face areas, with quads split in the halves (x,y,z), (z,w,x)
+    auto nt = (int)mesh->triangle.size(), n = nt + (int)mesh->quad.size();
+    auto weights = vector<double>(n);
+    for(auto t : range(nt)) {
+        auto& f = mesh->triangle[t];
+        weights[t] = _triangle_area(mesh->pos[f.x], mesh->pos[f.y], mesh->pos[f.z]);
+    }
+    sampler.quad_split.resize(mesh->quad.size());
+    for(auto q : range(mesh->quad.size())) {
+        auto& f = mesh->quad[q];
+        auto a1 = _triangle_area(mesh->pos[f.x], mesh->pos[f.y], mesh->pos[f.z]);
+        auto a2 = _triangle_area(mesh->pos[f.z], mesh->pos[f.w], mesh->pos[f.x]);
+        weights[nt+q] = a1 + a2;
+        sampler.quad_split[q] = (a1 + a2 > 0) ? a1 / (a1 + a2) : 0.5f;
+    }
+    auto total = 0.0;
+    for(auto w : weights) total += w;
+    sampler.area = total;
+    // every face keeps its slot until the table is built (faces are picked uniformly if there is no area)
+    sampler.prob.assign(n, 1);
+    sampler.alias.resize(n);
+    for(auto i : range(n)) sampler.alias[i] = i;
+    if(total <= 0) return sampler;
+    // pair each face with less than the average area with one with more, which covers the rest
+    // of its slot, until all slots are full
+    auto scaled = vector<double>(n);
+    auto small = vector<int>(), large = vector<int>();
+    for(auto i : range(n)) {
+        scaled[i] = weights[i] * n / total;
+        if(scaled[i] < 1) small.push_back(i);
+        else large.push_back(i);
+    }
+    while(not small.empty() and not large.empty()) {
+        auto s = small.back(), l = large.back();
+        small.pop_back(); large.pop_back();
+        sampler.prob[s] = scaled[s];
+        sampler.alias[s] = l;
+        scaled[l] = (scaled[l] + scaled[s]) - 1;
+        if(scaled[l] < 1) small.push_back(l);
+        else large.push_back(l);
+    }
+    return sampler;
+}
+
+SurfacePoint sample_surface(const SurfaceSampler& sampler, float r0, float r1, float r2) {
+    error_if_not(not sampler.prob.empty(), "no faces to sample");
+    auto mesh = sampler.mesh;
+    // pick a slot and keep its face or take its alias, using the rest of r0
+    auto n = (int)sampler.prob.size();
+    auto x = r0 * n;
+    auto slot = min((int)x, n-1);
+    auto point = SurfacePoint();
+    point.face = (x - slot < sampler.prob[slot]) ? slot : sampler.alias[slot];
+    // pick the half of quads by their area, using the rest of r1
+    auto nt = (int)mesh->triangle.size();
+    auto f = vec3i();
+    if(point.face < nt) f = mesh->triangle[point.face];
+    else {
+        auto& q = mesh->quad[point.face-nt];
+        auto split = sampler.quad_split[point.face-nt];
+        if(r1 < split) { f = {q.x,q.y,q.z}; r1 = r1 / split; }
+        else { f = {q.z,q.w,q.x}; r1 = (r1 - split) / (1 - split); }
+        r1 = min(r1, 1.0f);
+    }
+    // uniform point in the triangle, u = 1 - sqrt(r1) and v = r2 * sqrt(r1)
+    auto s = sqrt(r1);
+    auto u = 1 - s, v = r2 * s;
+    auto& a = mesh->pos[f.x];
+    auto& b = mesh->pos[f.y];
+    auto& c = mesh->pos[f.z];
+    point.pos = a + u*(b-a) + v*(c-a);
+    if(not mesh->norm.empty()) point.norm = normalize(mesh->norm[f.x]*(1-u-v) + mesh->norm[f.y]*u + mesh->norm[f.z]*v);
+    else point.norm = normalize(cross(b-a,c-a));
+    if(not mesh->texcoord.empty()) point.texcoord = mesh->texcoord[f.x]*(1-u-v) + mesh->texcoord[f.y]*u + mesh->texcoord[f.z]*v;
+    return point;
+}
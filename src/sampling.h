@@ -0,0 +1,30 @@
+#ifndef _SAMPLING_H_
+#define _SAMPLING_H_
+
+#include "scene.h"
+
+// point on a mesh surface
+struct SurfacePoint {
+    int     face = -1;              // face (triangles first, then quads)
+    vec3f   pos = zero3f;           // position (mesh coordinates)
+    vec3f   norm = z3f;             // normal interpolated from the vertex normals (the face normal if the mesh has none)
+    vec2f   texcoord = zero2f;      // texture coordinate (zero if the mesh has none)
+};
+
+// sampler of points uniformly distributed over the area of the triangles and quads of a mesh,
+// picking faces in constant time from an alias table (the mesh is not modified)
+struct SurfaceSampler {
+    Mesh*           mesh = nullptr; // sampled mesh
+    float           area = 0;       // total area
+    vector<float>   prob;           // probability of each face to be kept when its slot is picked
+    vector<int>     alias;          // face picked instead of each face when it is not kept
+    vector<float>   quad_split;     // fraction of the area of each quad in its first half (x,y,z), the other being (z,w,x)
+};
+
+// build a sampler over the faces of a mesh, proportional to their area (Vose's alias method)
+SurfaceSampler make_surface_sampler(Mesh* mesh);
+
+// sample a point from three uniform random numbers in [0,1)
+SurfacePoint sample_surface(const SurfaceSampler& sampler, float r0, float r1, float r2);
+
+#endif
@@ -19,6 +19,17 @@ vector<image3f*> get_textures(Scene* scene) {
     return vector<image3f*>(textures.begin(),textures.end());
 }
 
+vector<Mesh*> get_display_meshes(Scene* scene) {
+    auto meshes = scene->meshes;
+    auto shared = set<Mesh*>();
+    for(auto surface : scene->surfaces) {
+        if(not surface->_display_mesh or shared.count(surface->_display_mesh)) continue;
+        shared.insert(surface->_display_mesh);
+        meshes.push_back(surface->_display_mesh);
+    }
+    return meshes;
+}
+
 Camera* lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist) {
     auto camera = new Camera();
     camera->frame = lookat_frame(eye, center, up, true);
@@ -98,6 +109,13 @@ void json_set_value(const jsonvalue& json, vector<vector<mat4f>>& value) {
     value.resize(json.array_size());
     for(auto i : range(value.size())) json_set_value(json.array_element(i), value[i]);
 }
+void json_set_value(const jsonvalue& json, NormalWeight& value) {
+    auto name = json.as_string();
+    if(name == "face") value = normal_weight_face;
+    else if(name == "area") value = normal_weight_area;
+    else if(name == "angle") value = normal_weight_angle;
+    else error("unknown normal weight: %s\n", name.c_str());
+}
 
 template<typename T>
 void json_set_optvalue(const jsonvalue& json, T& value, const string& name) {
@@ -173,6 +191,7 @@ Material* json_parse_material(const jsonvalue& json) {
     json_set_optvalue(json, material->bump_factor, "bump_factor");
     json_set_optvalue(json, material->hair_count, "hair_count");
     json_set_optvalue(json, material->hair_length, "hair_length");
+    json_set_optvalue(json, material->hair_width, "hair_width");
     return material;
 }
 
@@ -253,7 +272,9 @@ Mesh* json_parse_mesh(const jsonvalue& json) {
     json_set_optvalue(json, mesh->subdivision_catmullclark_level, "subdivision_catmullclark_level");
     json_set_optvalue(json, mesh->subdivision_catmullclark_smooth, "subdivision_catmullclark_smooth");
     json_set_optvalue(json, mesh->subdivision_bezier_level, "subdivision_bezier_level");
+    json_set_optvalue(json, mesh->subdivision_bezier_tolerance, "subdivision_bezier_tolerance");
     json_set_optvalue(json, mesh->subdivision_level, "subdivision_level");
+    json_set_optvalue(json, mesh->normal_weight, "normal_weight");
     if(json.object_contains("animation")) mesh->animation = json_parse_frame_animation(json.object_element("animation"));
     if(json.object_contains("skinning")) mesh->skinning = json_parse_mesh_skinning(json.object_element("skinning"));
     if(json.object_contains("json_skinning")) mesh->skinning = json_parse_mesh_skinning(load_json(json.object_element("json_skinning").as_string()));
@@ -326,6 +347,9 @@ Scene* json_parse_scene(const jsonvalue& json) {
     json_set_optvalue(json, scene->image_width, "image_width");
     json_set_optvalue(json, scene->image_height, "image_height");
     json_set_optvalue(json, scene->image_samples, "image_samples");
+    json_set_optvalue(json, scene->subdivision_bezier_pixels, "subdivision_bezier_pixels");
+    json_set_optvalue(json, scene->subdivision_bezier_evaluate, "subdivision_bezier_evaluate");
+    json_set_optvalue(json, scene->random_seed, "random_seed");
     json_set_optvalue(json, scene->background, "background");
     json_parse_opttexture(json, scene->background_txt, "background_txt");
     json_set_optvalue(json, scene->ambient, "ambient");
@@ -336,10 +360,77 @@ Scene* json_parse_scene(const jsonvalue& json) {
     return scene;
 }
 
+// hash raw array data into h (FNV-1a)
+template<typename T>
+unsigned long long _hash_array(const vector<T>& values, unsigned long long h) {
+    auto bytes = (const unsigned char*)values.data();
+    for(auto i : range(values.size()*sizeof(T))) { h ^= bytes[i]; h *= 1099511628211ull; }
+    h ^= values.size(); h *= 1099511628211ull;
+    return h;
+}
+
+// hash mesh geometry
+unsigned long long _hash_mesh(Mesh* mesh) {
+    auto h = 14695981039346656037ull;
+    h = _hash_array(mesh->pos, h);
+    h = _hash_array(mesh->norm, h);
+    h = _hash_array(mesh->texcoord, h);
+    h = _hash_array(mesh->triangle, h);
+    h = _hash_array(mesh->quad, h);
+    h = _hash_array(mesh->point, h);
+    h = _hash_array(mesh->line, h);
+    h = _hash_array(mesh->spline, h);
+    return h;
+}
+
+// check whether two materials are the same (textures are shared through the texture cache)
+bool _same_material(Material* a, Material* b) {
+    if(a == b) return true;
+    return a->ke == b->ke and a->kd == b->kd and a->ks == b->ks and a->n == b->n and a->kr == b->kr and
+        a->hair_count == b->hair_count and a->hair_length == b->hair_length and a->hair_width == b->hair_width and
+        a->ke_txt == b->ke_txt and a->kd_txt == b->kd_txt and a->ks_txt == b->ks_txt and
+        a->kr_txt == b->kr_txt and a->norm_txt == b->norm_txt and a->bump_txt == b->bump_txt and
+        a->bump_factor == b->bump_factor and a->double_sided == b->double_sided and a->microfacet == b->microfacet;
+}
+
+// check whether two meshes can be drawn as instances of each other
+bool _same_instance(Mesh* a, Mesh* b) {
+    return a->pos == b->pos and a->norm == b->norm and a->texcoord == b->texcoord and
+        a->triangle == b->triangle and a->quad == b->quad and a->point == b->point and
+        a->line == b->line and a->spline == b->spline and _same_material(a->mat, b->mat) and
+        a->flat_shading == b->flat_shading and a->normal_weight == b->normal_weight and
+        a->subdivision_catmullclark_level == b->subdivision_catmullclark_level and
+        a->subdivision_catmullclark_smooth == b->subdivision_catmullclark_smooth and
+        a->subdivision_bezier_level == b->subdivision_bezier_level and
+        a->subdivision_bezier_tolerance == b->subdivision_bezier_tolerance and
+        a->subdivision_level == b->subdivision_level;
+}
+
+void instance_meshes(Scene* scene) {
+    // bucket meshes by geometry hash, checking for full equality on hash hits
+    auto buckets = map<unsigned long long,vector<Mesh*>>();
+    auto meshes = vector<Mesh*>();
+    for(auto mesh : scene->meshes) {
+        // animated meshes change per frame, so they are never shared
+        if(mesh->animation or mesh->skinning or mesh->simulation) { meshes.push_back(mesh); continue; }
+        auto& bucket = buckets[_hash_mesh(mesh)];
+        auto instanced = (Mesh*)nullptr;
+        for(auto other : bucket) if(_same_instance(mesh, other)) { instanced = other; break; }
+        if(not instanced) { bucket.push_back(mesh); meshes.push_back(mesh); continue; }
+        // move the mesh frames into the instance list of the first copy
+        if(instanced->instances.empty()) instanced->instances.push_back(instanced->frame);
+        if(mesh->instances.empty()) instanced->instances.push_back(mesh->frame);
+        else instanced->instances.insert(instanced->instances.end(), mesh->instances.begin(), mesh->instances.end());
+        delete mesh;
+    }
+    scene->meshes = meshes;
+}
+
 Scene* load_json_scene(const string& filename) {
     json_texture_cache.clear();
     json_texture_paths = { "" };
     auto scene = json_parse_scene(load_json(filename));
+    instance_meshes(scene);
     json_texture_cache.clear();
     json_texture_paths = { "" };
     return scene;
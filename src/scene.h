@@ -8,6 +8,7 @@
 
 // forward declarations
 struct BVHAccelerator;
+struct Mesh;
 
 // blinn-phong material
 // textures are scaled by the respective coefficient and may be missing
@@ -20,6 +21,7 @@ struct Material {
     
     int         hair_count = 0;    // number of hair to grow
     float       hair_length = 0.f; // length of hair
+    float       hair_width = 0.f;  // width of hair ribbons facing the camera (drawn as lines if zero)
     
     image3f*    ke_txt = nullptr;   // emission texture
     image3f*    kd_txt = nullptr;   // diffuse texture
@@ -78,6 +80,45 @@ struct MeshCollision {
     bool                    isquad;     // whether the collision object is a sphere or quad
 };
 
+// Mesh Culling Data
+struct MeshCulling {
+    // spatially coherent range of faces with its bounds, drawn as one element range
+    struct Cluster {
+        range3f             bbox;           // cluster bounding box (mesh coordinates)
+        vec3f               cone_axis = z3f;    // average face normal direction
+        float               cone_cutoff = 1;    // sine of the normal cone half-angle (1 if the cone is too wide to cull)
+        int                 triangle_start = 0; // first triangle
+        int                 triangle_count = 0; // number of triangles
+        int                 quad_start = 0;     // first quad
+        int                 quad_count = 0;     // number of quads
+    };
+    range3f                 bbox;           // mesh bounding box (mesh coordinates)
+    vector<Cluster>         clusters;       // face clusters (triangles first, then quads)
+};
+
+// Mesh Levels of Detail
+struct MeshLOD {
+    // simplified version of the mesh
+    struct Level {
+        Mesh*               mesh = nullptr; // simplified triangle mesh (same frame, material and instances)
+        float               error = 0;      // geometric error bound (mesh coordinates)
+    };
+    vector<Level>           levels;         // levels from finer to coarser
+};
+
+// Mesh Hair Data
+struct MeshHair {
+    int                     strand_vertices = 0;    // vertices of each strand, from the root
+    vector<vec3f>           pos;            // strand vertex positions, strand_vertices per strand, one strand after the other
+    vector<vec3f>           tangent;        // strand vertex tangents
+    vector<vec2f>           root_texcoord;  // surface texture coordinate at the root of each strand
+    vector<float>           length;         // length of each strand
+};
+
+// weights of the face normals averaged at vertices by smooth_normals: equal, by face area,
+// or by corner angle
+enum NormalWeight { normal_weight_face, normal_weight_area, normal_weight_angle };
+
 // indexed mesh data structure with vertex positions and normals,
 // a list of indices for triangle and quad faces, material and frame
 struct Mesh {
@@ -92,15 +133,24 @@ struct Mesh {
     vector<vec4i>   spline;                     // cubic bezier segments
     Material*       mat = new Material();       // material
     
+    vector<frame3f> instances;                  // instance frames (if not empty, drawn once per frame instead of at frame)
+    
+    bool            flat_shading = false;       // shade with face normals derived in the fragment shader (norm is ignored)
+    NormalWeight    normal_weight = normal_weight_face; // weights of the face normals in smoothed normals
+    
     int  subdivision_catmullclark_level = 0;        // catmullclark subdiv level
     bool subdivision_catmullclark_smooth = false;   // catmullclark subdiv smooth
     int  subdivision_bezier_level = 0;              // bezier subdiv level
+    float subdivision_bezier_tolerance = 0;         // bezier flatness tolerance (mesh coordinates), subdividing adaptively if positive
     int subdivision_level = 0;
     
     FrameAnimation* animation = nullptr;        // animation data
     MeshSkinning*   skinning = nullptr;         // skinning data
     MeshSimulation* simulation = nullptr;       // simulation data
     MeshCollision*  collision = nullptr;        // collision data
+    MeshCulling*    culling = nullptr;          // culling data
+    MeshLOD*        lod = nullptr;              // levels of detail
+    MeshHair*       hair = nullptr;             // hair strands
     
     BVHAccelerator* bvh = nullptr;              // bvh accelerator for intersection
 };
@@ -117,7 +167,7 @@ struct Surface {
 
     FrameAnimation* animation = nullptr;    // animation data
 
-    Mesh*       _display_mesh = nullptr;    // display mesh
+    Mesh*       _display_mesh = nullptr;    // display mesh (shared by all surfaces with the same shape and material)
 };
 
 // point light at frame.o with intensity intensity
@@ -172,11 +222,25 @@ struct Scene {
     int                 image_height = 512;     // image resolution in y
     int                 image_samples = 1;      // samples per pixels in each direction
     
+    float               subdivision_bezier_pixels = 0;  // bezier flatness tolerance on screen (pixels), subdividing adaptively if positive
+    bool                subdivision_bezier_evaluate = false;    // whether to tessellate splines by evaluating them instead of splitting
+    int                 random_seed = 0;        // seed of the random numbers generating geometry (hair)
+    
     bool                draw_wireframe = false; // whether to use wireframe for interactive drawing
     bool                draw_animated = false;  // whether to draw with animation
     bool                draw_gpu_skinning = false;  // whether skinning is performed on the gpu
     bool                draw_captureimage = false;  // whether to capture the image in the next frame
     bool                draw_normals = false;       // whether to draw normals for debugging
+    bool                draw_culling = true;        // whether to skip meshes and clusters outside the view
+    bool                draw_backface_culling = false;  // whether to skip clusters facing away from the camera
+    bool                draw_occlusion_culling = true;  // whether to skip meshes and clusters hidden by large occluders
+    bool                draw_lod = true;            // whether to draw simplified meshes when far away
+    bool                draw_depth_prepass = true;  // whether to lay down depth first so that each pixel is shaded once
+    bool                draw_msaa = true;           // whether to antialias with multisampling (image_samples^2 samples if supported)
+    float               lod_pixel_error = 1;        // maximum simplification error on screen (pixels)
+    bool                draw_clustered_lights = true;   // whether to shade each view cluster with the lights reaching it only
+    float               light_cutoff = 0.005f;      // intensity below which lights are ignored
+    bool                draw_shadows = true;        // whether to shadow the most important lights with shadow maps
     
     int                 path_max_depth = 2;     // maximum path depth
     bool                path_sample_brdf = true;// sample brdf in path tracing
@@ -186,12 +250,18 @@ struct Scene {
 // grab all scene textures
 vector<image3f*> get_textures(Scene* scene);
 
+// grab all meshes to display, including the shared surface display meshes
+vector<Mesh*> get_display_meshes(Scene* scene);
+
 // create a Camera at eye, pointing towards center with up vector up, and with specified image plane params
 Camera* lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist);
 
 // set camera view with a "turntable" modification
 void set_view_turntable(Camera* camera, float rotate_phi, float rotate_theta, float dolly, float pan_x, float pan_y);
 
+// merge meshes with identical geometry and material into one instanced mesh
+void instance_meshes(Scene* scene);
+
 // load a scene from a json file
 Scene* load_json_scene(const string& filename);
 
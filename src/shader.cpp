@@ -0,0 +1,255 @@
+#include "shader.h"
+
+#include <sys/stat.h>
+
+// magic number at the start of the program binaries file
+const unsigned int shader_binary_magic = 0x31424853;
+
+// modification time of a file (zero if it does not exist)
+long long _file_time(const string& filename) {
+    struct stat st;
+    if(stat(filename.c_str(), &st) != 0) return 0;
+    return (long long)st.st_mtime;
+}
+
+// read a text file, returning false if it cannot be opened
+bool _read_text_file(const string& filename, string& text) {
+    auto f = fopen(filename.c_str(),"r");
+    if(not f) return false;
+    text = "";
+    char line[4096];
+    while (fgets(line, 4096, f)) text += line;
+    fclose(f);
+    return true;
+}
+
+// 64-bit FNV-1a hash of a string, continuing from h
+unsigned long long _hash_string(const string& s, unsigned long long h = 14695981039346656037ull) {
+    for(auto c : s) { h ^= (unsigned char)c; h *= 1099511628211ull; }
+    return h;
+}
+
+// shader code for a feature set, with a define for each feature after the #version line
+string _shader_source(const string& code, int features) {
+    auto defines = string();
+    if(features & shader_kd_txt) defines += "#define MATERIAL_KD_TXT\n";
+    if(features & shader_ks_txt) defines += "#define MATERIAL_KS_TXT\n";
+    if(features & shader_norm_txt) defines += "#define MATERIAL_NORM_TXT\n";
+    if(features & shader_lines) defines += "#define MATERIAL_IS_LINES\n";
+    if(features & shader_clustered_lights) defines += "#define CLUSTERED_LIGHTS\n";
+    if(features & shader_shadows) defines += "#define SHADOWS\n";
+    if(features & shader_depth_only) defines += "#define DEPTH_ONLY\n";
+    if(features & shader_flat) defines += "#define FLAT_SHADING\n";
+    if(features & shader_ribbons) defines += "#define HAIR_RIBBONS\n";
+    auto start = (code.compare(0,8,"#version") == 0) ? code.find('\n') : string::npos;
+    if(start == string::npos) return defines + code;
+    return code.substr(0,start+1) + defines + code.substr(start+1);
+}
+
+// compile a shader, returning zero and printing the log if it does not compile
+int _compile_shader(int type, const string& code) {
+    auto id = glCreateShader(type);
+    auto codes = code.c_str();
+    glShaderSource(id, 1, &codes, nullptr);
+    glCompileShader(id);
+    int compiled;
+    glGetShaderiv(id, GL_COMPILE_STATUS, &compiled);
+    if(not compiled) {
+        char buf[10000];
+        glGetShaderInfoLog(id, 10000, 0, buf);
+        message("shader not compiled\n\n%s\n\n",buf);
+        glDeleteShader(id);
+        return 0;
+    }
+    return id;
+}
+
+// check whether a program is linked, printing the log if it is not
+bool _program_linked(int program_id, bool print_log) {
+    int linked;
+    glGetProgramiv(program_id, GL_LINK_STATUS, &linked);
+    if(not linked and print_log) {
+        char buf[10000];
+        glGetProgramInfoLog(program_id, 10000, 0, buf);
+        message("program not linked\n\n%s\n\n",buf);
+    }
+    return linked;
+}
+
+// delete a program and its shaders
+void _delete_program(const ShaderProgram& program) {
+    if(program.vertex_shader_id) glDeleteShader(program.vertex_shader_id);
+    if(program.fragment_shader_id) glDeleteShader(program.fragment_shader_id);
+    if(program.program_id) glDeleteProgram(program.program_id);
+}
+
+// save all program binaries
+void _save_binaries(ShaderCache* cache) {
+    auto f = fopen(cache->binary_filename.c_str(), "wb");
+    if(not f) return;
+    fwrite(&shader_binary_magic, sizeof(shader_binary_magic), 1, f);
+    for(auto& entry : cache->binaries) {
+        auto& binary = entry.second;
+        auto size = (unsigned int)binary.data.size();
+        fwrite(&entry.first, sizeof(entry.first), 1, f);
+        fwrite(&binary.hash, sizeof(binary.hash), 1, f);
+        fwrite(&binary.format, sizeof(binary.format), 1, f);
+        fwrite(&size, sizeof(size), 1, f);
+        fwrite(binary.data.data(), 1, size, f);
+    }
+    fclose(f);
+}
+
+// load the saved program binaries, ignoring the file if it is not valid
+void _load_binaries(ShaderCache* cache) {
+    auto f = fopen(cache->binary_filename.c_str(), "rb");
+    if(not f) return;
+    auto magic = 0u;
+    if(fread(&magic, sizeof(magic), 1, f) == 1 and magic == shader_binary_magic) {
+        while(true) {
+            auto features = 0;
+            auto binary = ShaderBinary();
+            auto size = 0u;
+            if(fread(&features, sizeof(features), 1, f) != 1) break;
+            if(fread(&binary.hash, sizeof(binary.hash), 1, f) != 1) break;
+            if(fread(&binary.format, sizeof(binary.format), 1, f) != 1) break;
+            if(fread(&size, sizeof(size), 1, f) != 1 or size > (1u << 26)) break;
+            binary.data.resize(size);
+            if(fread(binary.data.data(), 1, size, f) != size) break;
+            cache->binaries[features] = binary;
+        }
+    }
+    fclose(f);
+}
+
+// build the program for a feature set from its saved binary if valid, or from the shader code;
+// returns a program with zero handles if the code does not compile
+ShaderProgram _build_program(ShaderCache* cache, int features) {
+    auto program = ShaderProgram();
+    auto vertex_code = _shader_source(cache->vertex_code, features);
+    auto fragment_code = _shader_source(cache->fragment_code, features);
+    auto hash = _hash_string(cache->driver, _hash_string(fragment_code, _hash_string(vertex_code)));
+#ifdef GL_ARB_get_program_binary
+    // the driver may still reject a binary, in which case the program is compiled
+    if(cache->binary_supported and cache->binaries.count(features) and cache->binaries[features].hash == hash) {
+        auto& binary = cache->binaries[features];
+        program.program_id = glCreateProgram();
+        glProgramBinary(program.program_id, binary.format, binary.data.data(), binary.data.size());
+        if(_program_linked(program.program_id, false)) return program;
+        glDeleteProgram(program.program_id);
+        program.program_id = 0;
+    }
+#endif
+
+    // compile shaders
+    program.vertex_shader_id = _compile_shader(GL_VERTEX_SHADER, vertex_code);
+    program.fragment_shader_id = _compile_shader(GL_FRAGMENT_SHADER, fragment_code);
+    if(not program.vertex_shader_id or not program.fragment_shader_id) {
+        _delete_program(program);
+        return ShaderProgram();
+    }
+
+    // create program and attach shaders
+    program.program_id = glCreateProgram();
+    glAttachShader(program.program_id,program.vertex_shader_id);
+    glAttachShader(program.program_id,program.fragment_shader_id);
+
+    // bind vertex attributes locations
+    glBindAttribLocation(program.program_id, 0, "vertex_pos");
+    glBindAttribLocation(program.program_id, 1, "vertex_norm");
+    glBindAttribLocation(program.program_id, 2, "vertex_texcoord");
+    glBindAttribLocation(program.program_id, 3, "instance_frame");
+
+    // link program
+#ifdef GL_ARB_get_program_binary
+    if(cache->binary_supported) glProgramParameteri(program.program_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#endif
+    glLinkProgram(program.program_id);
+    if(not _program_linked(program.program_id, true)) {
+        _delete_program(program);
+        return ShaderProgram();
+    }
+
+#ifdef GL_ARB_get_program_binary
+    // save the binary for the next run
+    if(cache->binary_supported) {
+        auto length = 0;
+        glGetProgramiv(program.program_id, GL_PROGRAM_BINARY_LENGTH, &length);
+        if(length > 0) {
+            auto binary = ShaderBinary();
+            binary.hash = hash;
+            binary.data.resize(length);
+            glGetProgramBinary(program.program_id, length, nullptr, &binary.format, binary.data.data());
+            cache->binaries[features] = binary;
+            _save_binaries(cache);
+        }
+    }
+#endif
+    return program;
+}
+
+int shader_features(Material* mat, bool is_lines) {
+    auto features = 0;
+    if(mat->kd_txt) features |= shader_kd_txt;
+    if(mat->ks_txt) features |= shader_ks_txt;
+    if(mat->norm_txt) features |= shader_norm_txt;
+    if(is_lines) features |= shader_lines;
+    return features;
+}
+
+void init_shader_cache(ShaderCache* cache) {
+    // load shader code from files
+    cache->vertex_code = load_text_file(cache->vertex_filename.c_str());
+    cache->fragment_code = load_text_file(cache->fragment_filename.c_str());
+    cache->vertex_time = _file_time(cache->vertex_filename);
+    cache->fragment_time = _file_time(cache->fragment_filename);
+    // load binaries saved by the same driver
+#ifdef GL_ARB_get_program_binary
+    cache->binary_supported = gl_has_extension("GL_ARB_get_program_binary");
+#endif
+    auto renderer = (const char*)glGetString(GL_RENDERER);
+    auto version = (const char*)glGetString(GL_VERSION);
+    cache->driver = string((renderer) ? renderer : "") + " " + string((version) ? version : "");
+    if(cache->binary_supported) _load_binaries(cache);
+}
+
+int get_shader_program(ShaderCache* cache, int features) {
+    if(cache->programs.find(features) != cache->programs.end()) return cache->programs[features].program_id;
+    auto program = _build_program(cache, features);
+    error_if_not(program.program_id, "could not build shader program\n");
+    error_if_glerror();
+    cache->programs[features] = program;
+    return program.program_id;
+}
+
+bool reload_shaders(ShaderCache* cache) {
+    auto vertex_time = _file_time(cache->vertex_filename);
+    auto fragment_time = _file_time(cache->fragment_filename);
+    if(vertex_time == cache->vertex_time and fragment_time == cache->fragment_time) return false;
+    cache->vertex_time = vertex_time;
+    cache->fragment_time = fragment_time;
+    // files being saved may be missing for a moment, they are read again at the next change
+    auto vertex_code = string(), fragment_code = string();
+    if(not _read_text_file(cache->vertex_filename, vertex_code)) return false;
+    if(not _read_text_file(cache->fragment_filename, fragment_code)) return false;
+    if(vertex_code == cache->vertex_code and fragment_code == cache->fragment_code) return false;
+
+    // rebuild all the programs in use, keeping the old ones if any fails
+    auto old_vertex_code = cache->vertex_code, old_fragment_code = cache->fragment_code;
+    cache->vertex_code = vertex_code;
+    cache->fragment_code = fragment_code;
+    auto programs = map<int,ShaderProgram>();
+    for(auto& entry : cache->programs) {
+        auto program = _build_program(cache, entry.first);
+        if(not program.program_id) {
+            for(auto& built : programs) _delete_program(built.second);
+            cache->vertex_code = old_vertex_code;
+            cache->fragment_code = old_fragment_code;
+            return false;
+        }
+        programs[entry.first] = program;
+    }
+    for(auto& entry : cache->programs) _delete_program(entry.second);
+    cache->programs = programs;
+    return true;
+}
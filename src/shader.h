@@ -0,0 +1,61 @@
+#ifndef _SHADER_H_
+#define _SHADER_H_
+
+#include "glcommon.h"
+#include "scene.h"
+
+// material and lighting features compiled into separate shader permutations
+const int shader_kd_txt = 1;    // kd texture
+const int shader_ks_txt = 2;    // ks texture
+const int shader_norm_txt = 4;  // normal map
+const int shader_lines = 8;     // lines shaded with tangents
+const int shader_clustered_lights = 16; // lights read from the lists of the view clusters
+const int shader_shadows = 32;  // lights shadowed by cube shadow maps
+const int shader_depth_only = 64;   // depth only, streaming positions
+const int shader_flat = 128;    // face normals from the derivatives of the position
+const int shader_ribbons = 256; // hair ribbons expanded across their strands facing the camera
+
+// compiled shader program for a feature set
+struct ShaderProgram {
+    int program_id = 0;             // OpenGL program handle
+    int vertex_shader_id = 0;       // OpenGL vertex shader handle (zero if loaded from a binary)
+    int fragment_shader_id = 0;     // OpenGL fragment shader handle (zero if loaded from a binary)
+};
+
+// program binary saved between runs
+struct ShaderBinary {
+    unsigned long long hash = 0;    // hash of the sources, features and driver the binary was made from
+    unsigned int format = 0;        // binary format
+    vector<unsigned char> data;     // binary data
+};
+
+// cache of shader permutations built from the shader files, with program binaries saved
+// between runs and programs rebuilt when the files change
+struct ShaderCache {
+    string vertex_filename = "model_vertex.glsl";       // vertex shader file
+    string fragment_filename = "model_fragment.glsl";   // fragment shader file
+    string binary_filename = "model_shaders.cache";     // program binaries file
+    string vertex_code;                 // vertex shader code
+    string fragment_code;               // fragment shader code
+    long long vertex_time = 0;          // vertex shader file modification time
+    long long fragment_time = 0;        // fragment shader file modification time
+    bool binary_supported = false;      // whether program binaries are supported
+    string driver;                      // renderer and version, binaries are only valid for the same driver
+    map<int,ShaderProgram> programs;    // programs for each feature set
+    map<int,ShaderBinary> binaries;     // program binaries for each feature set
+};
+
+// feature set of a material
+int shader_features(Material* mat, bool is_lines);
+
+// load the shader files and the saved program binaries
+void init_shader_cache(ShaderCache* cache);
+
+// get the program for a feature set, loading it from a binary or compiling it on first use
+int get_shader_program(ShaderCache* cache, int features);
+
+// rebuild all programs if the shader files changed, keeping the old ones if the new code
+// does not compile; returns whether programs were rebuilt
+bool reload_shaders(ShaderCache* cache);
+
+#endif
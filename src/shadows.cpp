@@ -0,0 +1,128 @@
+#include "shadows.h"
+#include "lights.h"
+#include "culling.h"
+
+#include <algorithm>
+
+frame3f shadow_face_frame(const vec3f& pos, int face) {
+    auto d = zero3f;
+    d[face/2] = (face % 2) ? -1 : 1;
+    auto up = (face/2 == 1) ? z3f : y3f;
+    return frame3f(pos, cross(up, -d), up, -d);
+}
+
+vec4f shadow_rect(const ShadowAtlas& atlas, Light* light) {
+    for(auto& map : atlas.maps) {
+        if(map.light != light) continue;
+        return vec4f(map.origin.x / (float)atlas.size, map.origin.y / (float)atlas.size, map.face_size / (float)atlas.size, map.radius);
+    }
+    return vec4f(0,0,-1,0);
+}
+
+// 64-bit FNV-1a hash of a memory block, continuing from h
+unsigned long long _hash_bytes(const void* data, size_t size, unsigned long long h) {
+    auto bytes = (const unsigned char*)data;
+    for(auto i : range(size)) { h ^= bytes[i]; h *= 1099511628211ull; }
+    return h;
+}
+
+// hash of the meshes and their placement, which changes if any geometry moves
+unsigned long long _geometry_stamp(Scene* scene) {
+    auto h = 14695981039346656037ull;
+    for(auto mesh : get_display_meshes(scene)) {
+        h = _hash_bytes(&mesh, sizeof(mesh), h);
+        h = _hash_bytes(&mesh->frame, sizeof(mesh->frame), h);
+        if(not mesh->instances.empty()) h = _hash_bytes(mesh->instances.data(), mesh->instances.size()*sizeof(frame3f), h);
+        auto count = mesh->pos.size();
+        h = _hash_bytes(&count, sizeof(count), h);
+    }
+    return h;
+}
+
+// fraction of the image height covered by a light sphere radius, or zero if the sphere is not in view
+float _shadow_importance(Camera* camera, const Frustum& frustum, const vec3f& pos, float radius) {
+    if(not frustum_overlap(frustum, range3f(pos-vec3f(radius,radius,radius), pos+vec3f(radius,radius,radius)))) return 0;
+    auto d = dist(camera->frame.o, pos);
+    if(d <= radius) return 1;
+    return min(1.0f, radius / d * camera->dist / camera->height);
+}
+
+// pack blocks of 3x2 faces on shelves, largest first, shrinking the blocks that do not fit
+// until they reach the smallest face size; returns whether all blocks were placed
+bool _pack_shadow_maps(vector<ShadowMap>& maps, int size) {
+    auto all = true;
+    auto x = 0, y = 0, shelf = 0;
+    for(auto& map : maps) {
+        while(true) {
+            auto w = 3*map.face_size, h = 2*map.face_size;
+            if(x + w > size) { x = 0; y += shelf; shelf = 0; }
+            if(y + h <= size) {
+                map.origin = vec2i(x, y);
+                x += w;
+                shelf = max(shelf, h);
+                break;
+            }
+            if(map.face_size <= shadow_face_min) { map.face_size = 0; all = false; break; }
+            map.face_size /= 2;
+        }
+    }
+    return all;
+}
+
+void update_shadow_atlas(Scene* scene, ShadowAtlas* atlas) {
+    // rank the lights in view by the screen size of their radius
+    auto frustum = make_frustum(scene->camera, HUGE_VALF);
+    auto ranked = vector<pair<float,int>>();
+    for(auto i : range(scene->lights.size())) {
+        auto light = scene->lights[i];
+        auto radius = light_radius(light, scene->light_cutoff);
+        if(radius <= 0) continue;
+        auto importance = _shadow_importance(scene->camera, frustum, light->frame.o, radius);
+        if(importance > 0) ranked.push_back({importance, i});
+    }
+    std::sort(ranked.begin(), ranked.end(), [](const pair<float,int>& a, const pair<float,int>& b){ return a.first > b.first; });
+    if((int)ranked.size() > shadow_maps_max) ranked.resize(shadow_maps_max);
+
+    // face resolution of each light, the screen size of its radius rounded up to a power of two
+    auto maps = vector<ShadowMap>();
+    for(auto& r : ranked) {
+        auto map = ShadowMap();
+        map.light = scene->lights[r.second];
+        map.face_request = shadow_face_min;
+        while(map.face_request < shadow_face_max and map.face_request < r.first * scene->image_height) map.face_request *= 2;
+        map.face_size = map.face_request;
+        maps.push_back(map);
+    }
+
+    // keep the current packing if the same lights ask for the same resolution, so that moving
+    // the camera does not render the maps again
+    auto requests = map<Light*,int>();
+    for(auto& old : atlas->maps) requests[old.light] = old.face_request;
+    auto same = maps.size() == requests.size();
+    for(auto& m : maps) same = same and requests.count(m.light) and requests[m.light] == m.face_request;
+    if(not same) {
+        std::stable_sort(maps.begin(), maps.end(), [](const ShadowMap& a, const ShadowMap& b){ return a.face_request > b.face_request; });
+        _pack_shadow_maps(maps, atlas->size);
+        maps.erase(std::remove_if(maps.begin(), maps.end(), [](const ShadowMap& m){ return m.face_size == 0; }), maps.end());
+        // maps whose light, position and block did not change keep their faces
+        for(auto& map : maps) {
+            for(auto& old : atlas->maps) {
+                if(old.light != map.light or old.face_size != map.face_size or not (old.origin == map.origin)) continue;
+                map.pos = old.pos;
+                map.radius = old.radius;
+                map.dirty = old.dirty;
+            }
+        }
+        atlas->maps = maps;
+    }
+
+    // render again the maps of moved lights, or all of them if the geometry moved
+    auto stamp = _geometry_stamp(scene);
+    for(auto& map : atlas->maps) {
+        auto radius = light_radius(map.light, scene->light_cutoff);
+        if(not (map.pos == map.light->frame.o) or map.radius != radius or stamp != atlas->geometry_stamp) map.dirty = true;
+        map.pos = map.light->frame.o;
+        map.radius = radius;
+    }
+    atlas->geometry_stamp = stamp;
+}
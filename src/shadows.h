@@ -0,0 +1,50 @@
+#ifndef _SHADOWS_H_
+#define _SHADOWS_H_
+
+#include "scene.h"
+
+// maximum number of lights with shadow maps, picked by screen importance
+const int shadow_maps_max = 32;
+
+// shadow atlas resolution
+const int shadow_atlas_size = 4096;
+
+// largest and smallest cube face resolution
+const int shadow_face_max = 512;
+const int shadow_face_min = 64;
+
+// near distance of the cube faces as a fraction of their far distance (the light radius)
+const float shadow_near_ratio = 0.005f;
+
+// cube shadow map of a light, stored as six square faces in a 3x2 block of the atlas
+struct ShadowMap {
+    Light*      light = nullptr;    // light
+    vec3f       pos = zero3f;       // light position the faces were rendered from
+    float       radius = 0;         // light radius the faces were rendered to
+    int         face_request = 0;   // face resolution asked for by the light screen size
+    int         face_size = 0;      // face resolution (smaller than asked for if the atlas is full)
+    vec2i       origin = zero2i;    // block position in the atlas (pixels from the bottom left)
+    bool        dirty = true;       // whether the faces need to be rendered
+};
+
+// depth atlas holding the cube shadow maps of the most important lights
+struct ShadowAtlas {
+    int                 size = shadow_atlas_size;   // atlas resolution
+    vector<ShadowMap>   maps;                       // shadow maps
+    unsigned long long  geometry_stamp = 0;         // hash of the mesh placement the maps were rendered with
+    int                 faces_rendered = 0;         // faces rendered by the last update
+};
+
+// frame of the camera of a cube face (looking down -z), for faces +x, -x, +y, -y, +z, -z
+// (as in the shader, faces use y as up except +y and -y that use z)
+frame3f shadow_face_frame(const vec3f& pos, int face);
+
+// atlas rectangle (origin and face size in texture coordinates) and far distance of the shadow map
+// of a light, with a negative size if the light has none
+vec4f shadow_rect(const ShadowAtlas& atlas, Light* light);
+
+// pick the lights with shadows by screen importance and pack their maps in the atlas, marking
+// the maps to render when their light, their place in the atlas or the geometry changed
+void update_shadow_atlas(Scene* scene, ShadowAtlas* atlas);
+
+#endif
@@ -0,0 +1,282 @@
+#include "simplify.h"
+#include "culling.h"
+#include "tesselation.h"
+
+#include <algorithm>
+#include <queue>
+
+// weight of the planes that keep open boundaries in place
+const float simplify_boundary_weight = 10;
+
+// symmetric 4x4 quadric matrix, stored as its upper triangle
+struct _Quadric {
+    double a[10] = {0,0,0,0,0,0,0,0,0,0};
+};
+
+// quadric of the squared distance to the plane dot(n,p)+d = 0, scaled by w
+_Quadric _plane_quadric(const vec3f& n, float d, float w) {
+    auto q = _Quadric();
+    double v[4] = {n.x,n.y,n.z,d};
+    auto k = 0;
+    for(auto i : range(4)) for(auto j : range(i,4)) q.a[k++] = w*v[i]*v[j];
+    return q;
+}
+
+// accumulate a quadric
+void _add_quadric(_Quadric& q, const _Quadric& b) {
+    for(auto i : range(10)) q.a[i] += b.a[i];
+}
+
+// evaluate the quadric error at a point
+double _eval_quadric(const _Quadric& q, const vec3f& p) {
+    double v[4] = {p.x,p.y,p.z,1};
+    auto r = 0.0;
+    auto k = 0;
+    for(auto i : range(4)) for(auto j : range(i,4)) r += ((i==j)?1:2)*q.a[k++]*v[i]*v[j];
+    return r;
+}
+
+// candidate collapse of vertex u into vertex v, valid while both vertices are unchanged
+struct _Collapse {
+    double  cost;           // quadric error at v
+    int     u, v;           // vertices
+    int     u_version;      // version of u when the collapse was computed
+    int     v_version;      // version of v when the collapse was computed
+
+    // order by increasing cost in a priority queue
+    bool operator<(const _Collapse& c) const { return cost > c.cost; }
+};
+
+Mesh* simplify_mesh(Mesh* mesh, int target, float* error) {
+    // weld vertices with the same position and texture coordinates, so that faces connect
+    // across vertices duplicated for normals, while vertices on texture seams stay apart
+    // (attributes that do not cover every vertex, like the texture coordinates left behind by
+    // catmull-clark subdivision, are treated as missing)
+    auto has_texcoord = not mesh->texcoord.empty() and mesh->texcoord.size() == mesh->pos.size();
+    auto has_norm = not mesh->norm.empty() and mesh->norm.size() == mesh->pos.size();
+    auto welded = map<std::array<float,5>,int>();
+    auto remap = vector<int>(mesh->pos.size());
+    auto vert = vector<int>();
+    auto faceted = false;
+    for(auto i : range(mesh->pos.size())) {
+        auto& p = mesh->pos[i];
+        auto t = (has_texcoord) ? mesh->texcoord[i] : zero2f;
+        auto key = std::array<float,5>{{p.x,p.y,p.z,t.x,t.y}};
+        if(welded.find(key) == welded.end()) {
+            welded[key] = vert.size();
+            vert.push_back(i);
+        } else if(has_norm and dot(mesh->norm[i],mesh->norm[vert[welded[key]]]) < 0.999f) faceted = true;
+        remap[i] = welded[key];
+    }
+    auto nv = (int)vert.size();
+    auto pos = vector<vec3f>(nv);
+    for(auto i : range(nv)) pos[i] = mesh->pos[vert[i]];
+
+    // vertices on texture seams share their position with other vertices and are never moved
+    auto seam_count = map<std::array<float,3>,int>();
+    for(auto& p : pos) seam_count[{{p.x,p.y,p.z}}]++;
+    auto locked = vector<bool>(nv);
+    for(auto i : range(nv)) locked[i] = seam_count[{{pos[i].x,pos[i].y,pos[i].z}}] > 1;
+
+    // triangles, with quads split along the x-z diagonal
+    auto triangle = vector<vec3i>();
+    for(auto f : mesh->triangle) triangle.push_back(vec3i(remap[f.x],remap[f.y],remap[f.z]));
+    for(auto f : mesh->quad) {
+        triangle.push_back(vec3i(remap[f.x],remap[f.y],remap[f.z]));
+        triangle.push_back(vec3i(remap[f.x],remap[f.z],remap[f.w]));
+    }
+    auto alive = vector<bool>(triangle.size(), false);
+    auto vfaces = vector<vector<int>>(nv);
+    auto faces = 0;
+    for(auto i : range(triangle.size())) {
+        auto& f = triangle[i];
+        if(f.x == f.y or f.y == f.z or f.z == f.x) continue;
+        alive[i] = true;
+        faces++;
+        for(auto k : range(3)) vfaces[f[k]].push_back(i);
+    }
+
+    // vertex quadrics from the face planes, plus planes orthogonal to the open boundaries
+    auto quadric = vector<_Quadric>(nv);
+    auto edge_count = map<pair<int,int>,int>();
+    for(auto i : range(triangle.size())) {
+        if(not alive[i]) continue;
+        auto& f = triangle[i];
+        for(auto k : range(3)) edge_count[make_pair(min(f[k],f[(k+1)%3]),max(f[k],f[(k+1)%3]))]++;
+    }
+    auto boundary = vector<bool>(nv);
+    for(auto i : range(triangle.size())) {
+        if(not alive[i]) continue;
+        auto& f = triangle[i];
+        auto n = cross(pos[f.y]-pos[f.x], pos[f.z]-pos[f.x]);
+        if(lengthSqr(n) == 0) continue;
+        n = normalize(n);
+        auto q = _plane_quadric(n, -dot(n,pos[f.x]), 1);
+        for(auto k : range(3)) _add_quadric(quadric[f[k]], q);
+        for(auto k : range(3)) {
+            auto a = f[k], b = f[(k+1)%3];
+            if(edge_count[make_pair(min(a,b),max(a,b))] != 1) continue;
+            boundary[a] = boundary[b] = true;
+            auto en = cross(pos[b]-pos[a], n);
+            if(lengthSqr(en) == 0) continue;
+            en = normalize(en);
+            auto bq = _plane_quadric(en, -dot(en,pos[a]), simplify_boundary_weight);
+            _add_quadric(quadric[a], bq);
+            _add_quadric(quadric[b], bq);
+        }
+    }
+
+    // alive faces around a vertex (removing the dead ones as a side effect)
+    auto faces_of = [&](int u) -> vector<int>& {
+        auto& vf = vfaces[u];
+        vf.erase(std::remove_if(vf.begin(), vf.end(), [&](int f){ return not alive[f]; }), vf.end());
+        return vf;
+    };
+    // vertices adjacent to a vertex
+    auto neighbors_of = [&](int u) {
+        auto neighbors = set<int>();
+        for(auto f : faces_of(u)) for(auto k : range(3)) if(triangle[f][k] != u) neighbors.insert(triangle[f][k]);
+        return neighbors;
+    };
+    // check whether u can move to v without changing the topology or flipping faces
+    auto can_collapse = [&](int u, int v) {
+        if(locked[u]) return false;
+        auto opposite = set<int>();
+        for(auto f : faces_of(u)) {
+            auto& t = triangle[f];
+            if(t.x != v and t.y != v and t.z != v) continue;
+            for(auto k : range(3)) if(t[k] != u and t[k] != v) opposite.insert(t[k]);
+        }
+        if(opposite.empty()) return false;
+        // boundary vertices only move along the boundary
+        if(boundary[u] and opposite.size() != 1) return false;
+        // link condition: the vertices adjacent to both are the ones opposite to the edge
+        auto common = 0;
+        auto nu = neighbors_of(u), nv = neighbors_of(v);
+        for(auto w : nu) if(nv.count(w)) common++;
+        if(common != (int)opposite.size()) return false;
+        // faces that move with u must not degenerate or flip
+        for(auto f : faces_of(u)) {
+            auto t = triangle[f];
+            if(t.x == v or t.y == v or t.z == v) continue;
+            auto n0 = cross(pos[t.y]-pos[t.x], pos[t.z]-pos[t.x]);
+            for(auto k : range(3)) if(t[k] == u) t[k] = v;
+            auto n1 = cross(pos[t.y]-pos[t.x], pos[t.z]-pos[t.x]);
+            if(lengthSqr(n1) == 0 or dot(n0,n1) < 0.2f*length(n0)*length(n1)) return false;
+        }
+        return true;
+    };
+
+    // candidate collapses, ordered by their quadric error
+    auto version = vector<int>(nv, 0);
+    auto dead = vector<bool>(nv, false);
+    auto heap = std::priority_queue<_Collapse>();
+    auto push = [&](int u, int v) {
+        if(locked[u]) return;
+        auto q = quadric[u];
+        _add_quadric(q, quadric[v]);
+        heap.push({_eval_quadric(q,pos[v]), u, v, version[u], version[v]});
+    };
+    for(auto i : range(triangle.size())) {
+        if(not alive[i]) continue;
+        auto& f = triangle[i];
+        for(auto k : range(3)) { push(f[k],f[(k+1)%3]); push(f[(k+1)%3],f[k]); }
+    }
+
+    // collapse the cheapest edges until the target is reached
+    auto max_cost = 0.0f;
+    while(faces > target and not heap.empty()) {
+        auto c = heap.top();
+        heap.pop();
+        if(dead[c.u] or dead[c.v] or version[c.u] != c.u_version or version[c.v] != c.v_version) continue;
+        if(not can_collapse(c.u,c.v)) continue;
+        for(auto f : faces_of(c.u)) {
+            auto& t = triangle[f];
+            if(t.x == c.v or t.y == c.v or t.z == c.v) { alive[f] = false; faces--; continue; }
+            for(auto k : range(3)) if(t[k] == c.u) t[k] = c.v;
+            vfaces[c.v].push_back(f);
+        }
+        vfaces[c.u].clear();
+        dead[c.u] = true;
+        _add_quadric(quadric[c.v], quadric[c.u]);
+        version[c.v]++;
+        max_cost = max(max_cost, (float)c.cost);
+        for(auto w : neighbors_of(c.v)) { push(c.v,w); push(w,c.v); }
+    }
+
+    // copy the remaining vertices and faces
+    auto simplified = new Mesh();
+    simplified->frame = mesh->frame;
+    simplified->mat = mesh->mat;
+    simplified->instances = mesh->instances;
+    simplified->flat_shading = mesh->flat_shading;
+    auto index = vector<int>(nv, -1);
+    for(auto i : range(triangle.size())) {
+        if(not alive[i]) continue;
+        auto f = triangle[i];
+        for(auto k : range(3)) {
+            if(index[f[k]] < 0) {
+                index[f[k]] = simplified->pos.size();
+                simplified->pos.push_back(mesh->pos[vert[f[k]]]);
+                if(has_norm) simplified->norm.push_back(mesh->norm[vert[f[k]]]);
+                if(has_texcoord) simplified->texcoord.push_back(mesh->texcoord[vert[f[k]]]);
+            }
+            f[k] = index[f[k]];
+        }
+        simplified->triangle.push_back(f);
+    }
+    // faceted meshes were welded across their normals, so facet them again
+    if(faceted) facet_normals(simplified);
+
+    // quadric errors are sums of squared distances, so their root bounds the distance
+    *error = sqrt(max_cost);
+    return simplified;
+}
+
+void make_lods(Mesh* mesh) {
+    auto triangles = (int)(mesh->triangle.size() + 2*mesh->quad.size());
+    if(triangles < lod_min_triangles) return;
+    if(not mesh->lod) mesh->lod = new MeshLOD();
+    auto finer = mesh;
+    auto error = 0.0f;
+    while(triangles > lod_last_triangles) {
+        auto level = MeshLOD::Level();
+        auto level_error = 0.0f;
+        level.mesh = simplify_mesh(finer, triangles/2, &level_error);
+        // stop when seams and boundaries keep the mesh from getting simpler
+        if((int)level.mesh->triangle.size() > triangles*3/4) { delete level.mesh; break; }
+        // each level is simplified from the previous one, so errors add up
+        error += level_error;
+        level.error = error;
+        mesh->lod->levels.push_back(level);
+        finer = level.mesh;
+        triangles = (int)level.mesh->triangle.size();
+    }
+}
+
+void make_lods(Scene* scene) {
+    for(auto mesh : get_display_meshes(scene)) {
+        // animated, skinned or simulated meshes change every frame
+        if(mesh->animation or mesh->skinning or mesh->simulation) continue;
+        if(not mesh->point.empty() or not mesh->line.empty() or not mesh->spline.empty() or mesh->hair) continue;
+        make_lods(mesh);
+    }
+}
+
+Mesh* select_lod(Mesh* mesh, const frame3f& frame, Camera* camera, int image_height, float pixel_error) {
+    if(not mesh->lod or not mesh->culling) return mesh;
+    // distance from the camera to the bounding box
+    auto bbox = transform_bbox(frame, mesh->culling->bbox);
+    auto eye = camera->frame.o;
+    auto d = length(max(max(bbox.min-eye, eye-bbox.max), 0.0f));
+    if(d <= camera->dist) return mesh;
+    // pixels covered by a unit length in mesh coordinates at that distance
+    auto scale = max(length(frame.x), max(length(frame.y), length(frame.z)));
+    auto pixels = scale * camera->dist / d / camera->height * image_height;
+    auto selected = mesh;
+    for(auto& level : mesh->lod->levels) {
+        if(level.error * pixels > pixel_error) break;
+        selected = level.mesh;
+    }
+    return selected;
+}
@@ -0,0 +1,26 @@
+#ifndef _SIMPLIFY_H_
+#define _SIMPLIFY_H_
+
+#include "scene.h"
+
+// minimum number of triangles for a mesh to get levels of detail
+const int lod_min_triangles = 1024;
+
+// number of triangles below which no coarser level is made
+const int lod_last_triangles = 128;
+
+// simplify a mesh with quadric error edge collapses down to about target triangles,
+// keeping vertices on texture seams; returns a new triangle mesh and sets error to its error bound
+Mesh* simplify_mesh(Mesh* mesh, int target, float* error);
+
+// make a chain of levels of detail for a mesh, halving the triangles at each level
+void make_lods(Mesh* mesh);
+
+// make levels of detail for all static display meshes large enough to benefit from them
+void make_lods(Scene* scene);
+
+// pick the coarsest level of detail of a mesh drawn at frame whose error projects
+// to less than pixel_error pixels (returns the mesh itself if no level is coarse enough)
+Mesh* select_lod(Mesh* mesh, const frame3f& frame, Camera* camera, int image_height, float pixel_error);
+
+#endif
@@ -1,5 +1,30 @@
 #include "tesselation.h"
-#include <random>
+#include "sampling.h"
+
+// normalized cross products of the edges (b-a, c-a) of each corner triple (a,b,c),
+// computed four at a time with the batched kernels
+vector<vec3f> _corner_normals(const vector<vec3f>& pos, const vector<vec3i>& corners) {
+    auto e1 = vector<vec3f>(corners.size()), e2 = vector<vec3f>(corners.size());
+    for(auto i : range(corners.size())) {
+        e1[i] = pos[corners[i].y]-pos[corners[i].x];
+        e2[i] = pos[corners[i].z]-pos[corners[i].x];
+    }
+    auto normals = vector<vec3f>(corners.size());
+    cross_array(e1.data(), e2.data(), normals.data(), normals.size());
+    normalize_array(normals.data(), normals.data(), normals.size());
+    return normals;
+}
+
+// corner triples of the two triangles of each quad, (x,y,z) then the corners picked by second
+vector<vec3i> _quad_corners(const vector<vec4i>& quads, const vec3i& second) {
+    auto corners = vector<vec3i>();
+    corners.reserve(quads.size()*2);
+    for(auto& q : quads) {
+        corners.push_back({q.x,q.y,q.z});
+        corners.push_back({q[second.x],q[second.y],q[second.z]});
+    }
+    return corners;
+}
 
 // make normals for each face - duplicates all vertex data
 void facet_normals(Mesh* mesh) {
@@ -9,12 +34,16 @@ void facet_normals(Mesh* mesh) {
     auto texcoord = vector<vec2f>();
     auto triangle = vector<vec3i>();
     auto quad = vector<vec4i>();
+    // compute face normals of all triangles and of the two halves (x,y,z), (x,z,w) of all quads
+    auto triangle_normals = _corner_normals(mesh->pos, mesh->triangle);
+    auto quad_normals = _corner_normals(mesh->pos, _quad_corners(mesh->quad, {0,2,3}));
     // froeach triangle
-    for(auto f : mesh->triangle) {
+    for(auto t : range(mesh->triangle.size())) {
+        auto f = mesh->triangle[t];
         // grab current pos size
         auto nv = (int)pos.size();
-        // compute face face normal
-        auto fn = normalize(cross(mesh->pos[f.y]-mesh->pos[f.x], mesh->pos[f.z]-mesh->pos[f.x]));
+        // face face normal
+        auto fn = triangle_normals[t];
         // add triangle
         triangle.push_back({nv,nv+1,nv+2});
         // add vertex data
@@ -25,12 +54,12 @@ void facet_normals(Mesh* mesh) {
         }
     }
     // froeach quad
-    for(auto f : mesh->quad) {
+    for(auto q : range(mesh->quad.size())) {
+        auto f = mesh->quad[q];
         // grab current pos size
         auto nv = (int)pos.size();
-        // compute face normal
-        auto fn = normalize(normalize(cross(mesh->pos[f.y]-mesh->pos[f.x], mesh->pos[f.z]-mesh->pos[f.x])) +
-                            normalize(cross(mesh->pos[f.z]-mesh->pos[f.x], mesh->pos[f.w]-mesh->pos[f.x])));
+        // face normal
+        auto fn = normalize(quad_normals[2*q] + quad_normals[2*q+1]);
         // add quad
         quad.push_back({nv,nv+1,nv+2,nv+3});
         // add vertex data
@@ -46,37 +75,137 @@ void facet_normals(Mesh* mesh) {
     mesh->texcoord = texcoord;
     mesh->triangle = triangle;
     mesh->quad = quad;
+    mesh->flat_shading = false;
+}
+
+// face normals of triangles then quads, in parallel over ranges of faces, from the cross products h1, h2
+// of the edges of the halves (x,y,z), (z,w,x) of quads, or of triangles: (h1+h2)/2 normalized halves
+// if weighted by face (triangles repeat their half), and h1+h2, twice the area vector, otherwise
+// (triangles have no second half), normalized if weighted by angle; the edges of blocks of faces
+// are gathered in small buffers that stay in cache, then crossed and normalized by the batched kernels
+vector<vec3f> _face_normals(const vector<vec3f>& pos, const vector<vec3i>& triangle, const vector<vec4i>& quad, NormalWeight weight) {
+    const int block = 256;
+    auto faces_num = (int)(triangle.size()+quad.size());
+    auto normals = vector<vec3f>(faces_num);
+    auto second = (weight == normal_weight_face) ? vec3i(0,1,2) : vec3i(0,0,0);
+    parallel_for(faces_num, 4096, [&](int start, int end) {
+        vec3f e1[block], e2[block], e3[block], e4[block];
+        for(auto first = start; first < end; first += block) {
+            auto n = min(block, end-first);
+            for(auto i : range(n)) {
+                auto f = first+i;
+                vec3i c1, c2;
+                if(f < (int)triangle.size()) { auto& t = triangle[f]; c1 = t; c2 = {t[second.x],t[second.y],t[second.z]}; }
+                else { auto& q = quad[f-triangle.size()]; c1 = {q.x,q.y,q.z}; c2 = {q.z,q.w,q.x}; }
+                e1[i] = pos[c1.y]-pos[c1.x]; e2[i] = pos[c1.z]-pos[c1.x];
+                e3[i] = pos[c2.y]-pos[c2.x]; e4[i] = pos[c2.z]-pos[c2.x];
+            }
+            auto h1 = e1, h2 = e3, out = normals.data()+first;
+            cross_array(e1, e2, h1, n);
+            cross_array(e3, e4, h2, n);
+            if(weight == normal_weight_face) {
+                normalize_array(h1, h1, n);
+                normalize_array(h2, h2, n);
+                for(auto i : range(n)) out[i] = (h1[i] + h2[i]) * 0.5f;
+            } else {
+                for(auto i : range(n)) out[i] = h1[i] + h2[i];
+                if(weight == normal_weight_angle) normalize_array(out, out, n);
+            }
+        }
+    });
+    return normals;
+}
+
+// weight of a face normal at a face corner: one, or the corner angle if weighted by angle
+float _corner_weight(const vector<vec3f>& pos, const vector<vec3i>& triangle, const vector<vec4i>& quad, NormalWeight weight, int face, int corner) {
+    if(weight != normal_weight_angle) return 1;
+    int v, prev, next;
+    if(face < (int)triangle.size()) { auto& t = triangle[face]; v = t[corner]; prev = t[(corner+2)%3]; next = t[(corner+1)%3]; }
+    else { auto& q = quad[face-triangle.size()]; v = q[corner]; prev = q[(corner+3)%4]; next = q[(corner+1)%4]; }
+    auto p = pos[v];
+    return acos(clamp(dot(normalize(pos[next]-p), normalize(pos[prev]-p)), -1.0f, 1.0f));
+}
+
+// calls body(corner, face, k, vertex) on the k-th corners of the faces from first to last (triangles
+// then quads), numbering the corners of triangles then of quads
+template<typename F>
+void _for_corners(const vector<vec3i>& triangle, const vector<vec4i>& quad, int first, int last, const F& body) {
+    auto nt = (int)triangle.size();
+    for(auto f = first; f < min(last, nt); f++) for(auto k : range(3)) body(f*3+k, f, k, triangle[f][k]);
+    for(auto f = max(first, nt); f < last; f++) for(auto k : range(4)) body(nt*3+(f-nt)*4+k, f, k, quad[f-nt][k]);
+}
+
+// corners around each vertex as compressed rows: the corners of vertex v are corners[start[v]]
+// to corners[start[v+1]-1], in increasing order; built by a parallel counting sort that splits
+// the faces in ranges_num ranges, counts the corners of each vertex in each range, and places
+// the corners of each range after those of the previous ones
+void _vertex_corners(const vector<vec3i>& triangle, const vector<vec4i>& quad, int vertices_num, int ranges_num, vector<int>& start, vector<int>& corners) {
+    auto faces_num = (int)(triangle.size() + quad.size());
+    auto range_start = [&](int r) { return (int)((long long)faces_num*r/ranges_num); };
+    // corners of each vertex in each range
+    auto count = vector<vector<int>>(ranges_num);
+    parallel_for(ranges_num, 1, [&](int first, int last) {
+        for(auto r = first; r < last; r++) {
+            auto& range_count = count[r];
+            range_count.assign(vertices_num, 0);
+            _for_corners(triangle, quad, range_start(r), range_start(r+1), [&](int, int, int, int v) { range_count[v]++; });
+        }
+    });
+    // offset of each range within the corners of each vertex, and corners of each vertex
+    start.assign(vertices_num+1, 0);
+    parallel_for(vertices_num, 65536, [&](int first, int last) {
+        for(auto v = first; v < last; v++) {
+            auto offset = 0;
+            for(auto& range_count : count) { auto n = range_count[v]; range_count[v] = offset; offset += n; }
+            start[v+1] = offset;
+        }
+    });
+    for(auto v : range(vertices_num)) start[v+1] += start[v];
+    // place the corners of each range in order
+    corners.resize(start[vertices_num]);
+    parallel_for(ranges_num, 1, [&](int first, int last) {
+        for(auto r = first; r < last; r++) {
+            auto& range_count = count[r];
+            _for_corners(triangle, quad, range_start(r), range_start(r+1), [&](int c, int, int, int v) { corners[start[v] + range_count[v]++] = c; });
+        }
+    });
 }
 
 // smooth out normal - does not duplicate data
 void smooth_normals(Mesh* mesh) {
-    // PLACEHOLDER CODE - REMOVE AFTER FUNCTION IS IMPLEMENTED
-    //mesh->norm.resize(mesh->pos.size());
-    // YOUR CODE GOES HERE ---------------------
-    // set normals array to the same length as pos and init all elements to zero
-    mesh->norm = vector<vec3f>(mesh->pos.size(), zero3f);
-    // foreach triangle
-    for(auto triangle : mesh->triangle)
-    {
-        // compute face normal
-        vec3f normal = normalize(cross(mesh->pos[triangle[1]]-mesh->pos[triangle[0]], mesh->pos[triangle[2]]-mesh->pos[triangle[0]]));
-        // accumulate face normal to the vertex normals of each face index
-        for(int i : range(3))
-            mesh->norm[triangle[i]] += normal;
-    }
-    // foreach quad
-    for(auto quad : mesh->quad)
-    {
-        // compute face normal
-        //primo triangolo 0,1,2 - secondo triangolo 2,3,0
-        vec3f normal = (normalize(cross(mesh->pos[quad[1]]-mesh->pos[quad[0]], mesh->pos[quad[2]]-mesh->pos[quad[0]]))+normalize(cross(mesh->pos[quad[3]]-mesh->pos[quad[2]], mesh->pos[quad[0]]-mesh->pos[quad[2]])))/2.f;
-        // accumulate face normal to the vertex normals of each face index
-        for(int i : range(4))
-            mesh->norm[quad[i]] += normal;
+    auto& pos = mesh->pos;
+    auto& triangle = mesh->triangle;
+    auto& quad = mesh->quad;
+    auto& norm = mesh->norm;
+    auto weight = mesh->normal_weight;
+    auto faces_num = (int)(triangle.size() + quad.size());
+    auto face_normals = _face_normals(pos, triangle, quad, weight);
+    norm.assign(pos.size(), zero3f);
+    auto threads_num = parallel_threads(faces_num, 16384);
+    if(threads_num <= 1) {
+        // on one thread, add the normals at the corners of the faces in order
+        _for_corners(triangle, quad, 0, faces_num, [&](int, int f, int k, int v) {
+            norm[v] += face_normals[f] * _corner_weight(pos, triangle, quad, weight, f, k);
+        });
+    } else {
+        // otherwise each vertex gathers the normals of the faces around it, in the same order so that
+        // sums do not depend on the number of threads
+        auto start = vector<int>(), corners = vector<int>();
+        _vertex_corners(triangle, quad, pos.size(), threads_num, start, corners);
+        auto nt = (int)triangle.size()*3;
+        parallel_for(pos.size(), 4096, [&](int first, int last) {
+            for(auto v = first; v < last; v++) {
+                for(auto i = start[v]; i < start[v+1]; i++) {
+                    auto c = corners[i];
+                    auto f = (c < nt) ? c/3 : (int)triangle.size() + (c-nt)/4;
+                    auto k = (c < nt) ? c%3 : (c-nt)%4;
+                    norm[v] += face_normals[f] * _corner_weight(pos, triangle, quad, weight, f, k);
+                }
+            }
+        });
     }
     // normalize all vertex normals
-    for(int i : range(mesh->norm.size()))
-        mesh->norm[i] = normalize(mesh->norm[i]);
+    normalize_array(norm.data(), norm.data(), norm.size());
 }
 
 // smooth out tangents
@@ -128,7 +257,7 @@ void subdivide_mesh(Mesh* subdiv) {
         for(auto edge : emap.edges()){
             npos.push_back((catmull->pos[edge.x]+catmull->pos[edge.y])/2.f);
             texcoord.push_back((catmull->texcoord[edge.x]+catmull->texcoord[edge.y])/2.f);
-            norm.push_back((catmull->norm[edge.x]+catmull->norm[edge.y])/2.f);
+            if(not catmull->norm.empty()) norm.push_back((catmull->norm[edge.x]+catmull->norm[edge.y])/2.f);
         }
         // add vertices in the middle of each triangle
         for(auto tri : catmull->triangle){
@@ -139,7 +268,7 @@ void subdivide_mesh(Mesh* subdiv) {
         for(auto quad : catmull->quad){
             npos.push_back((catmull->pos[quad.x]+catmull->pos[quad.y]+catmull->pos[quad.z]+catmull->pos[quad.w])/4.f);
             texcoord.push_back((catmull->texcoord[quad.x]+catmull->texcoord[quad.y]+catmull->texcoord[quad.z]+catmull->texcoord[quad.w])/4.f);
-            norm.push_back((catmull->norm[quad.x]+catmull->norm[quad.y]+catmull->norm[quad.z]+catmull->norm[quad.w])/4.f);
+            if(not catmull->norm.empty()) norm.push_back((catmull->norm[quad.x]+catmull->norm[quad.y]+catmull->norm[quad.z]+catmull->norm[quad.w])/4.f);
         }
         // subdivision pass --------------------------------
         // compute an offset for the edge vertices //nelle pos dove cominciano gli edge? ecc
@@ -289,74 +418,168 @@ void subdivide_catmullclark(Mesh* subdiv) {
     }
     // clear subdivision
     catmull->subdivision_catmullclark_level = 0;
-    // according to smooth, either smooth_normals or facet_normals
-    if(catmull->subdivision_catmullclark_smooth) smooth_normals(catmull);
-    else facet_normals(catmull);
+    // smooth normals, or shade flat if not smooth, keeping vertices shared and without normals
+    // (facet_normals is the fallback that duplicates them)
+    catmull->flat_shading = not catmull->subdivision_catmullclark_smooth;
+    if(catmull->flat_shading) catmull->norm.clear();
+    else smooth_normals(catmull);
     // copy back
     *subdiv = *catmull;
     // clear
     free(catmull);
 }
 
+// largest distance of the inner control points of a segment from its chord, which bounds
+// the distance of the curve from the chord
+float _bezier_flatness(const vec3f& p0, const vec3f& p1, const vec3f& p2, const vec3f& p3) {
+    auto chord = p3-p0;
+    auto l2 = lengthSqr(chord);
+    auto flatness = 0.0f;
+    for(auto& p : {p1, p2}) {
+        auto v = p-p0;
+        if(l2 > 0) v -= chord * (dot(v,chord) / l2);
+        flatness = max(flatness, length(v));
+    }
+    return flatness;
+}
+
+// split a segment in the middle (de casteljau) recursively, until it is flat within tolerance or
+// depth splits were made, appending the control polygons of the final segments to pos and line
+// in curve order (p0 is the last position in pos, shared with the previous segment)
+void _split_bezier(const vec3f& p0, const vec3f& p1, const vec3f& p2, const vec3f& p3, int depth, float tolerance,
+                   vector<vec3f>& pos, vector<vec2i>& line) {
+    if(depth <= 0 or _bezier_flatness(p0, p1, p2, p3) <= tolerance) {
+        auto start = (int)pos.size()-1;
+        pos.push_back(p1);
+        pos.push_back(p2);
+        pos.push_back(p3);
+        for(auto k : range(3)) line.push_back(vec2i(start+k, start+k+1));
+        return;
+    }
+    // apply subdivision algorithm
+    vec3f q0 = (p0+p1)/2.f;
+    vec3f q2 = (p2+p3)/2.f;
+    vec3f r0 = (q0/2.f+(p1+p2)/4.f);
+    vec3f r1 = (q2/2.f+(p1+p2)/4.f);
+    vec3f s = (r0+r1)/2.f;
+    // split both halves, the first ending at the mid point the second starts from
+    _split_bezier(p0, q0, r0, s, depth-1, tolerance, pos, line);
+    _split_bezier(s, r1, q2, p3, depth-1, tolerance, pos, line);
+}
+
+// number of lines to tessellate a segment within tolerance, from the bound on the distance of a cubic
+// from its chords over n uniform steps, 3/4 max|p(i)-2p(i+1)+p(i+2)| / n^2 (at most max_lines, also
+// when a zero tolerance, like the one of a control point at the camera, makes n infinite or not a number)
+int _bezier_lines(const vec3f& p0, const vec3f& p1, const vec3f& p2, const vec3f& p3, float tolerance, int max_lines) {
+    auto m = max(length(p0-2*p1+p2), length(p1-2*p2+p3));
+    auto n = ceil(sqrt(0.75f * m / tolerance));
+    if(not (n <= max_lines)) return max_lines;
+    return (n < 1) ? 1 : (int)n;
+}
+
+// evaluate a segment at n+1 uniform parameters, evaluating the cubic and its derivative by forward
+// differencing; writes the positions and unit tangents, from p0 to exactly p3
+void _evaluate_bezier(const vec3f& p0, const vec3f& p1, const vec3f& p2, const vec3f& p3, int n, vec3f* pos, vec3f* tangent) {
+    // power basis a t^3 + b t^2 + c t + p0 and derivative 3a t^2 + 2b t + c
+    auto a = p3-p0+3*(p1-p2), b = 3*(p0-2*p1+p2), c = 3*(p1-p0);
+    auto h = 1.0f / n;
+    auto dp = a*(h*h*h) + b*(h*h) + c*h, ddp = a*(6*h*h*h) + b*(2*h*h), dddp = a*(6*h*h*h);
+    auto t = c, dt = a*(3*h*h) + b*(2*h), ddt = a*(6*h*h);
+    // tangent, or the chord if the derivative vanishes (coincident control points)
+    auto direction = [&](const vec3f& d) { return (lengthSqr(d) > 0) ? normalize(d) : normalize(p3-p0); };
+    auto p = p0;
+    pos[0] = p0;
+    tangent[0] = direction(t);
+    for(auto i : range(1, n+1)) {
+        p += dp; dp += ddp; ddp += dddp;
+        t += dt; dt += ddt;
+        // end exactly at the last control point, shared with the next segment
+        pos[i] = (i == n) ? p3 : p;
+        tangent[i] = direction(t);
+    }
+}
+
+// tessellate a segment into n lines of points at uniform parameters; appends the positions and unit
+// tangents after the first point, the last in pos, whose tangent (the last in norm) gets the start
+// tangent (summed if shared)
+void _evaluate_bezier(const vec3f& p0, const vec3f& p1, const vec3f& p2, const vec3f& p3, int n,
+                      vector<vec3f>& pos, vector<vec3f>& norm, vector<vec2i>& line) {
+    auto start = (int)pos.size()-1;
+    auto shared = norm.back();
+    pos.resize(start+n+1);
+    norm.resize(start+n+1);
+    _evaluate_bezier(p0, p1, p2, p3, n, &pos[start], &norm[start]);
+    norm[start] = normalize(shared + norm[start]);
+    for(auto i : range(1, n+1)) line.push_back(vec2i(start+i-1, start+i));
+}
+
+// flatness tolerance of a segment in mesh coordinates: the mesh tolerance, and the size of pixel_tolerance
+// pixels at the view distance of its nearest control point, over the mesh instances (infinite if neither is set)
+float _bezier_tolerance(Mesh* bezier, const vec4i& segment, Camera* camera, int image_height, float pixel_tolerance) {
+    auto tolerance = (bezier->subdivision_bezier_tolerance > 0) ? bezier->subdivision_bezier_tolerance : HUGE_VALF;
+    if(not camera or pixel_tolerance <= 0) return tolerance;
+    auto frames = (bezier->instances.empty()) ? vector<frame3f>{bezier->frame} : bezier->instances;
+    auto d = HUGE_VALF;
+    for(auto& frame : frames) for(auto k : range(4)) d = min(d, dist(camera->frame.o, transform_point(frame, bezier->pos[segment[k]])));
+    return min(tolerance, pixel_tolerance * d * camera->height / (camera->dist * image_height));
+}
+
 // subdivide bezier spline into line segments (assume bezier has only bezier segments and no lines)
-void subdivide_bezier(Mesh* bezier) {
-    // YOUR CODE GOES HERE ---------------------
+// writing only the final vertices, in curve order, after the vertices of the other elements
+void subdivide_bezier(Mesh* bezier, Camera* camera, int image_height, float pixel_tolerance, bool evaluate) {
     // skip is needed
     if(!bezier->subdivision_bezier_level) return;
-    // allocate a working polyline from bezier
-    Mesh* polyline = new Mesh(*bezier);
-    // foreach level
-    for(int lvl : range(bezier->subdivision_bezier_level))
-    {
-        // make new arrays of positions and bezier segments
-        // copy all the vertices into the new array (this waste space but it is easier for now)
-        vector<vec3f> npos(polyline->pos); //nella mesh non c'è un puntatore posso tenere sullo stack
-        vector<vec4i> segments = vector<vec4i>();
-        // foreach bezier segment
-        for(vec4i segment : polyline->spline)
-        {
-            // apply subdivision algorithm
-            vec3f q0 = (polyline->pos[segment.x]+polyline->pos[segment.y])/2.f;
-            vec3f q2 = (polyline->pos[segment.z]+polyline->pos[segment.w])/2.f;
-            vec3f r0 = (q0/2.f+(polyline->pos[segment.y]+polyline->pos[segment.z])/4.f);
-            vec3f r1 = (q2/2.f+(polyline->pos[segment.y]+polyline->pos[segment.z])/4.f);
-            vec3f s = (r0+r1)/2.f;
-            // prepare indices for two new segments
-            int lastIndex = npos.size();
-            auto spline0 = vec4i(segment.x, lastIndex+1, lastIndex+2, lastIndex);
-            auto spline1 = vec4i(lastIndex, lastIndex+3, lastIndex+4, segment.w);
-            // add mid point
-            npos.push_back(s);
-            // add points for first segment and fix segment indices
-            npos.push_back(q0);
-            npos.push_back(r0);
-            // add points for second segment and fix segment indices
-            npos.push_back(r1);
-            npos.push_back(q2);
-            // add indices for both segments into new segments array
-            segments.push_back(spline0);
-            segments.push_back(spline1);
-        }
-        // set new arrays pos, segments into the working lineset
-        polyline->pos = npos; //non è un puntatore
-        polyline->spline = segments;
+    auto level = bezier->subdivision_bezier_level;
+    auto adaptive = bezier->subdivision_bezier_tolerance > 0 or (camera and pixel_tolerance > 0);
+    // keep the vertices of the faces and points, compacted in their order
+    auto remap = vector<int>(bezier->pos.size(), -1);
+    for(auto& f : bezier->triangle) for(auto k : range(3)) remap[f[k]] = 0;
+    for(auto& f : bezier->quad) for(auto k : range(4)) remap[f[k]] = 0;
+    for(auto& p : bezier->point) remap[p] = 0;
+    auto pos = vector<vec3f>(), norm = vector<vec3f>();
+    auto texcoord = vector<vec2f>();
+    for(auto i : range(bezier->pos.size())) {
+        if(remap[i] < 0) continue;
+        remap[i] = pos.size();
+        pos.push_back(bezier->pos[i]);
+        if(i < (int)bezier->norm.size()) norm.push_back(bezier->norm[i]);
+        if(i < (int)bezier->texcoord.size()) texcoord.push_back(bezier->texcoord[i]);
     }
-    // copy bezier segments into line segments
-    polyline->line.clear();
-    for(vec4i seg : polyline->spline)
-    {
-        polyline->line.push_back(vec2i(seg.x, seg.y));
-        polyline->line.push_back(vec2i(seg.y, seg.z));
-        polyline->line.push_back(vec2i(seg.z, seg.w));
+    for(auto& f : bezier->triangle) for(auto k : range(3)) f[k] = remap[f[k]];
+    for(auto& f : bezier->quad) for(auto k : range(4)) f[k] = remap[f[k]];
+    for(auto& p : bezier->point) p = remap[p];
+    // uniform subdivision makes 2^level segments of three lines per spline, with one more start
+    // vertex for splines not continuing the previous one (evaluation makes as many lines)
+    auto line = vector<vec2i>();
+    if(not adaptive) {
+        pos.reserve(pos.size() + bezier->spline.size()*(3*(1 << level)+1));
+        line.reserve(bezier->spline.size()*3*(1 << level));
+        if(evaluate) norm.reserve(pos.capacity());
     }
-    // clear bezier array from lines
-    polyline->spline.clear();
-    // run smoothing to get proper tangents
-    smooth_tangents(polyline);
-    // copy back
-    *bezier = *polyline;
-    // clear
-    free(polyline);
+    // evaluated tangents are written with the positions
+    if(evaluate) norm.resize(pos.size(), zero3f);
+    // foreach bezier segment, split it uniformly (never flat) or until flat, or evaluate it
+    for(auto i : range(bezier->spline.size())) {
+        auto segment = bezier->spline[i];
+        auto& p0 = bezier->pos[segment.x], & p1 = bezier->pos[segment.y], & p2 = bezier->pos[segment.z], & p3 = bezier->pos[segment.w];
+        if(i == 0 or segment.x != bezier->spline[i-1].w) {
+            pos.push_back(p0);
+            if(evaluate) norm.push_back(zero3f);
+        }
+        auto tolerance = (adaptive) ? _bezier_tolerance(bezier, segment, camera, image_height, pixel_tolerance) : -1;
+        if(evaluate) _evaluate_bezier(p0, p1, p2, p3, (adaptive) ? _bezier_lines(p0, p1, p2, p3, tolerance, 3 << level) : 3 << level, pos, norm, line);
+        else _split_bezier(p0, p1, p2, p3, level, tolerance, pos, line);
+    }
+    if(adaptive) { pos.shrink_to_fit(); norm.shrink_to_fit(); line.shrink_to_fit(); }
+    // set back mesh data, clearing bezier array from lines
+    if(not texcoord.empty()) texcoord.resize(pos.size(), zero2f);
+    bezier->pos = std::move(pos);
+    bezier->norm = std::move(norm);
+    bezier->texcoord = std::move(texcoord);
+    bezier->line = std::move(line);
+    bezier->spline.clear();
+    // run smoothing to get proper tangents (evaluated tangents are exact)
+    if(not evaluate) smooth_tangents(bezier);
 }
 
 Mesh* make_surface_mesh(frame3f frame, float radius, bool isquad, Material* mat, float offset) {
@@ -388,14 +611,24 @@ Mesh* make_surface_mesh(frame3f frame, float radius, bool isquad, Material* mat,
     return mesh;
 }
 
-void subdivide_surface(Surface* surface) {
-    surface->_display_mesh = make_surface_mesh(
-        surface->frame, surface->radius, surface->isquad, surface->mat);
+void subdivide_surfaces(vector<Surface*>& surfaces) {
+    // one unit display mesh per shape and material, with the radius folded into the instance frames
+    auto display_meshes = map<pair<bool,Material*>,Mesh*>();
+    for(auto surface : surfaces) {
+        auto& mesh = display_meshes[{surface->isquad,surface->mat}];
+        if(not mesh) mesh = make_surface_mesh(identity_frame3f, 1, surface->isquad, surface->mat);
+        auto frame = surface->frame;
+        frame.x *= surface->radius; frame.y *= surface->radius; frame.z *= surface->radius;
+        mesh->instances.push_back(frame);
+        surface->_display_mesh = mesh;
+    }
 }
 
 void apply_bump(Mesh* mesh)
 {
     auto tex = mesh->mat->bump_txt;
+    // flat shaded meshes have no normals, so displace along smoothed ones
+    if(mesh->norm.empty()) smooth_normals(mesh);
     for(int i = 0; i < mesh->pos.size(); i++)
     {
         auto x = (tex->width()-1)*mesh->texcoord[i].x;
@@ -404,103 +637,61 @@ void apply_bump(Mesh* mesh)
         mesh->pos[i] += mesh->norm[i] * mesh->mat->bump_factor * length(tcord);//sqrt(length(tcord)* mesh->mat->bump_factor);//length(tcord);
     }
     //facet_normals(mesh);
-    smooth_normals(mesh);
+    if(mesh->flat_shading) mesh->norm.clear();
+    else smooth_normals(mesh);
     //mesh->subdivision_catmullclark_level = 2;
     //subdivide_catmullclark(mesh);
 }
 
-float get_quad_area(Mesh* m, int idx)
-{
-    auto quad = m->quad[idx];
-    vec3f a,b,c,d;
-    a = m->pos[quad.x];
-    b = m->pos[quad.y];
-    c = m->pos[quad.z];
-    d = m->pos[quad.w];
-    auto bd = d-b;
-    auto ac = c-a;
-    return length(cross(ac,bd))/2.f;
-}
-
-float get_triangle_area(Mesh* m, int idx)
-{
-    auto tri = m->triangle[idx];
-    vec3f a,b,c;
-    a = m->pos[tri.x];
-    b = m->pos[tri.y];
-    c = m->pos[tri.z];
-    auto ab = b-a;
-    auto ac = c-a;
-    return length(cross(ab,ac))/2.f;
+// counter-based random numbers (philox 4x32 with 10 rounds): four independent 32-bit numbers
+// for each counter and key, so that any element of a stream is computed without the previous ones
+std::array<unsigned int,4> _philox(std::array<unsigned int,4> counter, std::array<unsigned int,2> key) {
+    for(auto i = 0; i < 10; i++) {
+        auto p0 = 0xD2511F53ull * counter[0], p1 = 0xCD9E8D57ull * counter[2];
+        counter = {{ (unsigned int)(p1 >> 32) ^ counter[1] ^ key[0], (unsigned int)p1,
+                     (unsigned int)(p0 >> 32) ^ counter[3] ^ key[1], (unsigned int)p0 }};
+        key[0] += 0x9E3779B9u; key[1] += 0xBB67AE85u;
+    }
+    return counter;
 }
 
-struct compute_area : public std::unary_function<int,double> {
-    Mesh* mesh;
-    bool operator() (int idx) {return get_triangle_area(mesh, idx);}
-};
+// uniform random number in [0,1) from 32 random bits
+float _uniform(unsigned int bits) { return (bits >> 8) / 16777216.0f; }
 
-vec3f get_random_point_triangle(Mesh* mesh, vec3i tri, std::mt19937& generator)
-{
-    auto A = mesh->pos[tri.x];
-    auto B = mesh->pos[tri.y];
-    auto C = mesh->pos[tri.z];
-    //u = 1 - sqrt(r1) and v = r2 * sqrt(r1)
-    auto r1 = sqrt(generator()/((float)generator.max()));
-    auto r2 = generator()/((float)generator.max());
-    auto u = 1 - r1;
-    auto v = r2 * r1;
-    auto p = A + u*(B-A) + v*(C-A);
-    return p;
-}
+// vertices of each hair strand, as many as splitting its spline three times makes
+const int hair_strand_vertices = (3 << 3) + 1;
 
-vec3f get_random_point_quad(Mesh* mesh, vec4i quad, std::mt19937& generator)
+// grow hair strands on the faces in parallel, at points picked proportionally to the face area,
+// evaluating the spline of each strand at a fixed number of vertices written at its index, apart from
+// the surface; each strand draws its random numbers from the counter-based generator at its index,
+// so that strands do not depend on the number of threads
+void grow_hair(Mesh* mesh, unsigned int seed, unsigned int stream)
 {
-    if((generator()/((float)generator.max())) > .5f)
-    {
-        return get_random_point_triangle(mesh, {quad.x, quad.y,quad.z}, generator);
-    }
-    return get_random_point_triangle(mesh, {quad.z, quad.w,quad.x}, generator);
-    auto A = mesh->pos[quad.x];
-    auto B = mesh->pos[quad.y];
-    auto C = mesh->pos[quad.w];
-    //u = 1 - sqrt(r1) and v = r2 * sqrt(r1)
-    auto r1 = sqrt((generator()-generator.min())/((float)generator.max()+1));
-    auto r2 = (generator()-generator.min())/((float)generator.max()+1);
-    auto u = 1 - r1;
-    auto v = r2 * r1;
-    auto p = A + u*(B-A) + v*(C-A);
-    return p;
-}
-
-void grow_hair(Mesh* mesh)
-{
-    for(auto quad : mesh->quad){
-        mesh->triangle.push_back({quad.x,quad.y,quad.z});
-        mesh->triangle.push_back({quad.z,quad.w,quad.x});
-    }
-    mesh->quad.clear();
-    vector<float> weights = vector<float>();
-    for(int i = 0; i < mesh->triangle.size(); i++)
-        weights.push_back(get_triangle_area(mesh, i));
-    std::random_device rd;
-    std::mt19937 generator(rd());  // mt19937 is a standard mersenne_twister_engine
-    std::discrete_distribution<> dist(weights.begin(), weights.end());//dist(size, 0, size, op);
-    for (int i=0; i < mesh->mat->hair_count; ++i) {
-        int t = dist(generator);
-        auto tri = mesh->triangle[t];
-        // calculate position
-        vec3f random_point = get_random_point_triangle(mesh, tri, generator);
-        //vec3f normal = t >= size ? (normalize(cross(mesh->pos[quad[1]]-mesh->pos[quad[0]], mesh->pos[quad[2]]-mesh->pos[quad[0]]))+normalize(cross(mesh->pos[quad[3]]-mesh->pos[quad[2]], mesh->pos[quad[0]]-mesh->pos[quad[2]])))/2.f : normalize(cross(mesh->pos[tri.y]-mesh->pos[tri.x], mesh->pos[tri.z]-mesh->pos[tri.x]));
-        //la normale e' interpolata
-        vec3f normal = normalize((((mesh->norm[tri.x] + mesh->norm[tri.y] + mesh->norm[tri.z])/3.f)/((mesh->pos[tri.x] + mesh->pos[tri.y] + mesh->pos[tri.z])/3.f))*random_point);
-        int pos = mesh->pos.size();
-        mesh->pos.push_back(random_point);
-        mesh->pos.push_back(random_point + normal*0.4f);
-        mesh->pos.push_back(random_point + normal*0.4f+vec3f(0.0f,-0.4f,0.0f));
-        mesh->pos.push_back(random_point + normal*0.4f+vec3f(0.0f,-0.8f,0.0f));
-        mesh->spline.push_back({pos, pos+1, pos+2, pos+3});
-    }
-    mesh->subdivision_bezier_level=3;
+    auto sampler = make_surface_sampler(mesh);
+    if(sampler.prob.empty()) return;
+    // the three legs of the control polygon make up the hair length (0.4 each if not set)
+    auto leg = (mesh->mat->hair_length > 0) ? mesh->mat->hair_length / 3 : 0.4f;
+    auto count = mesh->mat->hair_count, n = hair_strand_vertices;
+    if(not mesh->hair) mesh->hair = new MeshHair();
+    auto hair = mesh->hair;
+    hair->strand_vertices = n;
+    hair->pos.resize(count*n);
+    hair->tangent.resize(count*n);
+    hair->root_texcoord.resize(count);
+    hair->length.resize(count);
+    parallel_for(count, 4096, [&](int start, int end) {
+        for (int i = start; i < end; ++i) {
+            auto r = _philox({{(unsigned int)i, 0, 0, 0}}, {{seed, stream}});
+            // root, then up along the interpolated normal and falling down
+            auto point = sample_surface(sampler, _uniform(r[0]), _uniform(r[1]), _uniform(r[2]));
+            auto p1 = point.pos + point.norm*leg;
+            _evaluate_bezier(point.pos, p1, p1+vec3f(0.0f,-leg,0.0f), p1+vec3f(0.0f,-2*leg,0.0f), n-1, &hair->pos[i*n], &hair->tangent[i*n]);
+            hair->root_texcoord[i] = point.texcoord;
+            auto length = 0.0f;
+            for(auto k : range(1, n)) length += dist(hair->pos[i*n+k-1], hair->pos[i*n+k]);
+            hair->length[i] = length;
+        }
+    });
     //If your parallelogram is defined by the points ABCD such that AB, BC, CD and DA are the sides, then take your point as being:
     
     //p = A + uAB + bAD
@@ -511,16 +702,15 @@ void grow_hair(Mesh* mesh)
 }
 
 void subdivide(Scene* scene) {
-    for(auto mesh : scene->meshes) {
+    for(auto i : range(scene->meshes.size())) {
+        auto mesh = scene->meshes[i];
         if(mesh->mat->hair_count)
-            grow_hair(mesh);
+            grow_hair(mesh, scene->random_seed, i);
         if(mesh->subdivision_catmullclark_level) subdivide_catmullclark(mesh);
         if(mesh->subdivision_level) subdivide_mesh(mesh);
-        if(mesh->subdivision_bezier_level) subdivide_bezier(mesh);
+        if(mesh->subdivision_bezier_level) subdivide_bezier(mesh, scene->camera, scene->image_height, scene->subdivision_bezier_pixels, scene->subdivision_bezier_evaluate);
         if(mesh->mat->bump_txt)
             apply_bump(mesh);
     }
-    for(auto surface : scene->surfaces) {
-        subdivide_surface(surface);
-    }
+    subdivide_surfaces(scene->surfaces);
 }
@@ -33,10 +33,11 @@ struct EdgeMap {
     }
 };
 
-// set face normals (duplicating vertices)
+// set face normals (duplicating vertices), the CPU fallback of flat shading
 void facet_normals(Mesh* mesh);
 
-// compute smoothed normals
+// compute smoothed normals, weighted by mesh->normal_weight (in parallel, with results that do not
+// depend on the number of threads)
 void smooth_normals(Mesh* mesh);
 
 // compute smoothed line tangents
@@ -48,11 +49,15 @@ void subdivide(Scene* scene);
 // apply catmull-clark subdivision to the mesh recursively
 void subdivide_catmullclark(Mesh* subdiv);
 
-// apply bezier spline subdivision
-void subdivide_bezier(Mesh* splines);
+// apply bezier spline subdivision, splitting segments subdivision_bezier_level times, or adaptively
+// up to that many times until they are flat within the mesh tolerance or within pixel_tolerance pixels
+// seen from camera at image_height (if either is positive); if evaluate, segments are instead evaluated
+// at as many uniform parameters as lines the splitting makes (or as needed for the tolerance),
+// with exact tangents
+void subdivide_bezier(Mesh* splines, Camera* camera = nullptr, int image_height = 0, float pixel_tolerance = 0, bool evaluate = false);
 
-// make display meshes for surfaces
-void subdivide_surface(Surface* surface);
+// make instanced display meshes for surfaces, sharing one mesh for each shape and material
+void subdivide_surfaces(vector<Surface*>& surfaces);
 
 // make a surface mesh
 Mesh* make_surface_mesh(frame3f frame, float radius, bool isquad, Material* mat, float offset = 0);
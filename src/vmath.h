@@ -4,6 +4,13 @@
 #include <cmath>
 #include <cstdlib>
 #include <array>
+#include <vector>
+
+// SSE packets when available (always on x64)
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define VMATH_SSE
+#include <xmmintrin.h>
+#endif
 
 #define PIf 3.14159265f
 #define PI 3.1415926535897932384626433832795
@@ -655,4 +662,282 @@ inline range3f make_range3f(std::initializer_list<vec3f> points) { auto bbox = r
 inline std::array<vec3f,8> corners(const range3f& a) { std::array<vec3f,8> ret; ret[0] = vec3f(a.min.x,a.min.y,a.min.z); ret[1] = vec3f(a.min.x,a.min.y,a.max.z); ret[2] = vec3f(a.min.x,a.max.y,a.min.z); ret[3] = vec3f(a.min.x,a.max.y,a.max.z); ret[4] = vec3f(a.max.x,a.min.y,a.min.z); ret[5] = vec3f(a.max.x,a.min.y,a.max.z); ret[6] = vec3f(a.max.x,a.max.y,a.min.z); ret[7] = vec3f(a.max.x,a.max.y,a.max.z); return ret; }
 
 
+// 4-wide Float Packet
+// four floats processed together, with SSE when available and a scalar fallback;
+// comparisons give masks (all bits set where true) that select between values
+#ifdef VMATH_SSE
+struct float4 { __m128 m; };
+#else
+struct float4 { float m[4]; };
+#endif
+
+// 4-wide packet construction, loads and stores ----
+#ifdef VMATH_SSE
+inline float4 splat4(float v) { return {_mm_set1_ps(v)}; }
+inline float4 load4(const float* p) { return {_mm_loadu_ps(p)}; }
+inline void store4(float* p, const float4& a) { _mm_storeu_ps(p, a.m); }
+#else
+inline float4 splat4(float v) { return {{v,v,v,v}}; }
+inline float4 load4(const float* p) { return {{p[0],p[1],p[2],p[3]}}; }
+inline void store4(float* p, const float4& a) { for(int i = 0; i < 4; i++) p[i] = a.m[i]; }
+#endif
+
+// 4-wide packet arithmetic and functions ------------
+#ifdef VMATH_SSE
+inline float4 operator+(const float4& a, const float4& b) { return {_mm_add_ps(a.m,b.m)}; }
+inline float4 operator-(const float4& a, const float4& b) { return {_mm_sub_ps(a.m,b.m)}; }
+inline float4 operator*(const float4& a, const float4& b) { return {_mm_mul_ps(a.m,b.m)}; }
+inline float4 operator/(const float4& a, const float4& b) { return {_mm_div_ps(a.m,b.m)}; }
+inline float4 min(const float4& a, const float4& b) { return {_mm_min_ps(a.m,b.m)}; }
+inline float4 max(const float4& a, const float4& b) { return {_mm_max_ps(a.m,b.m)}; }
+inline float4 sqrt(const float4& a) { return {_mm_sqrt_ps(a.m)}; }
+inline float4 cmpge(const float4& a, const float4& b) { return {_mm_cmpge_ps(a.m,b.m)}; }
+inline float4 cmple(const float4& a, const float4& b) { return {_mm_cmple_ps(a.m,b.m)}; }
+inline float4 cmpeq(const float4& a, const float4& b) { return {_mm_cmpeq_ps(a.m,b.m)}; }
+inline float4 mask_and(const float4& a, const float4& b) { return {_mm_and_ps(a.m,b.m)}; }
+inline float4 select(const float4& mask, const float4& a, const float4& b) { return {_mm_or_ps(_mm_and_ps(mask.m,a.m),_mm_andnot_ps(mask.m,b.m))}; }
+#else
+inline float4 operator+(const float4& a, const float4& b) { float4 r; for(int i = 0; i < 4; i++) r.m[i] = a.m[i]+b.m[i]; return r; }
+inline float4 operator-(const float4& a, const float4& b) { float4 r; for(int i = 0; i < 4; i++) r.m[i] = a.m[i]-b.m[i]; return r; }
+inline float4 operator*(const float4& a, const float4& b) { float4 r; for(int i = 0; i < 4; i++) r.m[i] = a.m[i]*b.m[i]; return r; }
+inline float4 operator/(const float4& a, const float4& b) { float4 r; for(int i = 0; i < 4; i++) r.m[i] = a.m[i]/b.m[i]; return r; }
+inline float4 min(const float4& a, const float4& b) { float4 r; for(int i = 0; i < 4; i++) r.m[i] = min(a.m[i],b.m[i]); return r; }
+inline float4 max(const float4& a, const float4& b) { float4 r; for(int i = 0; i < 4; i++) r.m[i] = max(a.m[i],b.m[i]); return r; }
+inline float4 sqrt(const float4& a) { float4 r; for(int i = 0; i < 4; i++) r.m[i] = sqrt(a.m[i]); return r; }
+inline float4 cmpge(const float4& a, const float4& b) { float4 r; for(int i = 0; i < 4; i++) r.m[i] = a.m[i] >= b.m[i]; return r; }
+inline float4 cmple(const float4& a, const float4& b) { float4 r; for(int i = 0; i < 4; i++) r.m[i] = a.m[i] <= b.m[i]; return r; }
+inline float4 cmpeq(const float4& a, const float4& b) { float4 r; for(int i = 0; i < 4; i++) r.m[i] = a.m[i] == b.m[i]; return r; }
+inline float4 mask_and(const float4& a, const float4& b) { float4 r; for(int i = 0; i < 4; i++) r.m[i] = a.m[i] and b.m[i]; return r; }
+inline float4 select(const float4& mask, const float4& a, const float4& b) { float4 r; for(int i = 0; i < 4; i++) r.m[i] = (mask.m[i]) ? a.m[i] : b.m[i]; return r; }
+#endif
+inline float4 madd(const float4& a, const float4& b, const float4& c) { return a*b+c; }
+
+// 3d Vector Packet
+// four 3d vectors stored by component (SoA), to run vector math on four at a time
+struct vec3f4 {
+    float4 x; // x components
+    float4 y; // y components
+    float4 z; // z components
+};
+
+// 3d packet construction, loads and stores ---------
+inline vec3f4 splat4(const vec3f& v) { return {splat4(v.x), splat4(v.y), splat4(v.z)}; }
+#ifdef VMATH_SSE
+// four consecutive vectors (12 floats) loaded as three registers and transposed
+inline vec3f4 load4(const vec3f* p) {
+    auto a = _mm_loadu_ps(&p[0].x), b = _mm_loadu_ps(&p[1].y), c = _mm_loadu_ps(&p[2].z);
+    auto d = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1,1,2,2)), e = _mm_shuffle_ps(a, b, _MM_SHUFFLE(0,0,1,1));
+    auto f = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2,2,3,3)), g = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1,1,2,2));
+    return {{_mm_shuffle_ps(a, d, _MM_SHUFFLE(2,0,3,0))}, {_mm_shuffle_ps(e, f, _MM_SHUFFLE(2,0,2,0))}, {_mm_shuffle_ps(g, c, _MM_SHUFFLE(3,0,2,0))}};
+}
+inline void store4(vec3f* p, const vec3f4& v) {
+    auto a = _mm_shuffle_ps(_mm_shuffle_ps(v.x.m, v.y.m, _MM_SHUFFLE(0,0,0,0)), _mm_shuffle_ps(v.z.m, v.x.m, _MM_SHUFFLE(1,1,0,0)), _MM_SHUFFLE(2,0,2,0));
+    auto b = _mm_shuffle_ps(_mm_shuffle_ps(v.y.m, v.z.m, _MM_SHUFFLE(1,1,1,1)), _mm_shuffle_ps(v.x.m, v.y.m, _MM_SHUFFLE(2,2,2,2)), _MM_SHUFFLE(2,0,2,0));
+    auto c = _mm_shuffle_ps(_mm_shuffle_ps(v.z.m, v.x.m, _MM_SHUFFLE(3,3,2,2)), _mm_shuffle_ps(v.y.m, v.z.m, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(2,0,2,0));
+    _mm_storeu_ps(&p[0].x, a); _mm_storeu_ps(&p[1].y, b); _mm_storeu_ps(&p[2].z, c);
+}
+#else
+inline vec3f4 load4(const vec3f* p) { vec3f4 r; for(int i = 0; i < 4; i++) { r.x.m[i] = p[i].x; r.y.m[i] = p[i].y; r.z.m[i] = p[i].z; } return r; }
+inline void store4(vec3f* p, const vec3f4& v) { for(int i = 0; i < 4; i++) p[i] = vec3f(v.x.m[i], v.y.m[i], v.z.m[i]); }
+#endif
+
+// 3d packet arithmetic operators -------------------
+inline vec3f4 operator+(const vec3f4& a, const vec3f4& b) { return {a.x+b.x, a.y+b.y, a.z+b.z}; }
+inline vec3f4 operator-(const vec3f4& a, const vec3f4& b) { return {a.x-b.x, a.y-b.y, a.z-b.z}; }
+inline vec3f4 operator*(const vec3f4& a, const float4& b) { return {a.x*b, a.y*b, a.z*b}; }
+inline vec3f4 operator*(const float4& a, const vec3f4& b) { return {a*b.x, a*b.y, a*b.z}; }
+inline vec3f4 operator/(const vec3f4& a, const float4& b) { return {a.x/b, a.y/b, a.z/b}; }
+
+// 3d packet operations (same results as the vec3f ones) --
+// dot product
+inline float4 dot(const vec3f4& a, const vec3f4& b) { return a.x*b.x+a.y*b.y+a.z*b.z; }
+// length
+inline float4 length(const vec3f4& a) { return sqrt(dot(a,a)); }
+// normalization (zero vectors stay zero)
+inline vec3f4 normalize(const vec3f4& a) { auto l = length(a); auto z = cmpeq(l, splat4(0)), zero = splat4(0); auto n = a / select(z, splat4(1), l); return {select(z, zero, n.x), select(z, zero, n.y), select(z, zero, n.z)}; }
+// cross product
+inline vec3f4 cross(const vec3f4& a, const vec3f4& b) { return {a.y*b.z-a.z*b.y, a.z*b.x-a.x*b.z, a.x*b.y-a.y*b.x}; }
+// frame transforms
+inline vec3f4 transform_point(const frame3f& f, const vec3f4& v) { return splat4(f.o) + splat4(f.x) * v.x + splat4(f.y) * v.y + splat4(f.z) * v.z; }
+inline vec3f4 transform_vector(const frame3f& f, const vec3f4& v) { return splat4(f.x) * v.x + splat4(f.y) * v.y + splat4(f.z) * v.z; }
+// matrix transform (with the homogeneous divide)
+inline vec3f4 transform_point(const mat4f& m, const vec3f4& v) {
+    auto row = [&](const vec4f& r) { return splat4(r.x)*v.x + splat4(r.y)*v.y + splat4(r.z)*v.z + splat4(r.w); };
+    auto w = row(m.w);
+    return {row(m.x)/w, row(m.y)/w, row(m.z)/w};
+}
+
+// 3d Vector Array (SoA)
+// allocator of arrays aligned to A bytes
+template<typename T, int A>
+struct aligned_allocator {
+    typedef T value_type;
+    template<typename U> struct rebind { typedef aligned_allocator<U,A> other; };
+    aligned_allocator() { }
+    template<typename U> aligned_allocator(const aligned_allocator<U,A>&) { }
+    // allocates A extra bytes to align the array, keeping the start of the allocation before it
+    T* allocate(size_t n) {
+        auto raw = (char*)malloc(n*sizeof(T) + A + sizeof(void*));
+        if(not raw) throw std::bad_alloc();
+        auto p = (char*)(((size_t)(raw + sizeof(void*)) + A-1) & ~(size_t)(A-1));
+        ((void**)p)[-1] = raw;
+        return (T*)p;
+    }
+    void deallocate(T* p, size_t) { free(((void**)p)[-1]); }
+};
+template<typename T, typename U, int A> inline bool operator==(const aligned_allocator<T,A>&, const aligned_allocator<U,A>&) { return true; }
+template<typename T, typename U, int A> inline bool operator!=(const aligned_allocator<T,A>&, const aligned_allocator<U,A>&) { return false; }
+
+// vectors stored by component in separate 32-byte aligned arrays, so that kernels read whole
+// packets with aligned loads; arrays are padded to a multiple of four by repeating the last vector
+struct vec3f_soa {
+    std::vector<float,aligned_allocator<float,32>> x;  // x components
+    std::vector<float,aligned_allocator<float,32>> y;  // y components
+    std::vector<float,aligned_allocator<float,32>> z;  // z components
+
+    // Default constructor (empty array)
+    vec3f_soa() : _n(0) { }
+    // Size constructor (zero vectors)
+    explicit vec3f_soa(int n) : _n(0) { resize(n); }
+
+    // number of vectors
+    int size() const { return _n; }
+    // resize the arrays, setting new vectors to zero
+    void resize(int n) { auto padded = (n+3) & ~3; x.resize(padded, 0); y.resize(padded, 0); z.resize(padded, 0); _n = n; pad(); }
+    // element access
+    vec3f at(int i) const { return vec3f(x[i], y[i], z[i]); }
+    // element update
+    void set(int i, const vec3f& v) { x[i] = v.x; y[i] = v.y; z[i] = v.z; }
+    // repeat the last vector in the padding (call after writing the last vector)
+    void pad() { for(auto i = _n; i < (int)x.size(); i++) { x[i] = (_n) ? x[_n-1] : 0; y[i] = (_n) ? y[_n-1] : 0; z[i] = (_n) ? z[_n-1] : 0; } }
+
+private:
+    int _n; // number of vectors
+};
+
+// 3d array conversions -----------------------------
+// convert an array of vectors to components
+inline vec3f_soa to_soa(const std::vector<vec3f>& v) {
+    auto soa = vec3f_soa((int)v.size());
+    for(auto i = 0; i < (int)v.size(); i++) soa.set(i, v[i]);
+    soa.pad();
+    return soa;
+}
+// convert components to an array of vectors
+inline std::vector<vec3f> to_aos(const vec3f_soa& soa) {
+    auto v = std::vector<vec3f>(soa.size());
+    for(auto i = 0; i < soa.size(); i++) v[i] = soa.at(i);
+    return v;
+}
+
+// 3d array packet access ---------------------------
+// vectors i to i+3 (i multiple of four, within the padding)
+#ifdef VMATH_SSE
+inline vec3f4 load4(const vec3f_soa& v, int i) { return {{_mm_load_ps(&v.x[i])}, {_mm_load_ps(&v.y[i])}, {_mm_load_ps(&v.z[i])}}; }
+inline void store4(vec3f_soa& v, int i, const vec3f4& p) { _mm_store_ps(&v.x[i], p.x.m); _mm_store_ps(&v.y[i], p.y.m); _mm_store_ps(&v.z[i], p.z.m); }
+// vectors at four indices
+inline vec3f4 gather4(const vec3f_soa& v, int i0, int i1, int i2, int i3) { return {{_mm_setr_ps(v.x[i0],v.x[i1],v.x[i2],v.x[i3])}, {_mm_setr_ps(v.y[i0],v.y[i1],v.y[i2],v.y[i3])}, {_mm_setr_ps(v.z[i0],v.z[i1],v.z[i2],v.z[i3])}}; }
+#else
+inline vec3f4 load4(const vec3f_soa& v, int i) { return {load4(&v.x[i]), load4(&v.y[i]), load4(&v.z[i])}; }
+inline void store4(vec3f_soa& v, int i, const vec3f4& p) { store4(&v.x[i], p.x); store4(&v.y[i], p.y); store4(&v.z[i], p.z); }
+inline vec3f4 gather4(const vec3f_soa& v, int i0, int i1, int i2, int i3) { return {{{v.x[i0],v.x[i1],v.x[i2],v.x[i3]}}, {{v.y[i0],v.y[i1],v.y[i2],v.y[i3]}}, {{v.z[i0],v.z[i1],v.z[i2],v.z[i3]}}}; }
+#endif
+
+// batched kernels over arrays ----------------------
+// four elements at a time with packets if SSE is available, the rest with the scalar operations
+// (out may alias the inputs)
+#ifdef VMATH_SSE
+const bool vmath_packets = true;
+#else
+const bool vmath_packets = false;
+#endif
+// transform points by a frame
+inline void transform_point_array(const frame3f& f, const vec3f* v, vec3f* out, int count) {
+    auto i = 0;
+    for(; vmath_packets and i+4 <= count; i += 4) store4(out+i, transform_point(f, load4(v+i)));
+    for(; i < count; i++) out[i] = transform_point(f, v[i]);
+}
+// transform points by a matrix
+inline void transform_point_array(const mat4f& m, const vec3f* v, vec3f* out, int count) {
+    auto i = 0;
+    for(; vmath_packets and i+4 <= count; i += 4) store4(out+i, transform_point(m, load4(v+i)));
+    for(; i < count; i++) out[i] = transform_point(m, v[i]);
+}
+// transform vectors by a frame
+inline void transform_vector_array(const frame3f& f, const vec3f* v, vec3f* out, int count) {
+    auto i = 0;
+    for(; vmath_packets and i+4 <= count; i += 4) store4(out+i, transform_vector(f, load4(v+i)));
+    for(; i < count; i++) out[i] = transform_vector(f, v[i]);
+}
+// normalize vectors
+inline void normalize_array(const vec3f* v, vec3f* out, int count) {
+    auto i = 0;
+    for(; vmath_packets and i+4 <= count; i += 4) store4(out+i, normalize(load4(v+i)));
+    for(; i < count; i++) out[i] = normalize(v[i]);
+}
+// cross products of pairs of vectors
+inline void cross_array(const vec3f* a, const vec3f* b, vec3f* out, int count) {
+    auto i = 0;
+    for(; vmath_packets and i+4 <= count; i += 4) store4(out+i, cross(load4(a+i), load4(b+i)));
+    for(; i < count; i++) out[i] = cross(a[i], b[i]);
+}
+// dot products of pairs of vectors
+inline void dot_array(const vec3f* a, const vec3f* b, float* out, int count) {
+    auto i = 0;
+    for(; vmath_packets and i+4 <= count; i += 4) store4(out+i, dot(load4(a+i), load4(b+i)));
+    for(; i < count; i++) out[i] = dot(a[i], b[i]);
+}
+
+// union of the four boxes in packets of minima and maxima
+inline range3f _bounds4(const vec3f4& lo, const vec3f4& hi) {
+    float l[3][4], h[3][4];
+    store4(l[0], lo.x); store4(l[1], lo.y); store4(l[2], lo.z);
+    store4(h[0], hi.x); store4(h[1], hi.y); store4(h[2], hi.z);
+    auto bbox = range3f();
+    for(auto k = 0; k < 4; k++) bbox = runion(bbox, range3f(vec3f(l[0][k],l[1][k],l[2][k]), vec3f(h[0][k],h[1][k],h[2][k])));
+    return bbox;
+}
+
+// bounding box of the vectors
+inline range3f bounds(const std::vector<vec3f>& v) {
+    auto bbox = range3f();
+    auto i = 0;
+    if(vmath_packets and v.size() >= 4) {
+        auto lo = load4(v.data()), hi = lo;
+        for(i = 4; i+4 <= (int)v.size(); i += 4) {
+            auto p = load4(v.data()+i);
+            lo = {min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z)};
+            hi = {max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z)};
+        }
+        bbox = _bounds4(lo, hi);
+    }
+    for(; i < (int)v.size(); i++) bbox = runion(bbox, v[i]);
+    return bbox;
+}
+
+// batched kernels over component arrays ------------
+// whole packets including the padding, so no remainder (without SSE packets are scalar loops)
+// bounding box of the vectors
+inline range3f bounds(const vec3f_soa& v) {
+    if(not v.size()) return range3f();
+    auto lo = load4(v, 0), hi = lo;
+    for(auto i = 4; i < (int)v.x.size(); i += 4) {
+        auto p = load4(v, i);
+        lo = {min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z)};
+        hi = {max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z)};
+    }
+    return _bounds4(lo, hi);
+}
+// normalize the vectors in place
+inline void normalize_array(vec3f_soa& v) {
+    for(auto i = 0; i < (int)v.x.size(); i += 4) store4(v, i, normalize(load4(v, i)));
+}
+// move the vectors along directions by amounts (amounts has one value per vector)
+inline void displace_array(vec3f_soa& v, const vec3f_soa& dir, const std::vector<float>& amount) {
+    auto i = 0;
+    for(; i+4 <= v.size(); i += 4) store4(v, i, load4(v, i) + load4(dir, i) * load4(&amount[i]));
+    for(; i < v.size(); i++) v.set(i, v.at(i) + dir.at(i) * amount[i]);
+    v.pad();
+}
+
 #endif
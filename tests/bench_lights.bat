@@ -0,0 +1 @@
+for %%l in (1 4 16 64 256 1024 4096) do ..\bin\Release\model.exe -r 720 -l %%l -q 10 31_lights.json
@@ -0,0 +1,5 @@
+# time shading with 1 to 4096 random point lights (frame time and light binning statistics of the 10th frame)
+for lights in 1 4 16 64 256 1024 4096; do
+    echo "lights: $lights"
+    ../bin/model -r 720 -l $lights -q 10 31_lights.json
+done
@@ -0,0 +1,88 @@
+#include "../../src/tesselation.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+// Benchmark of bezier spline tessellation
+// subdivide_bezier is run directly on synthetic strands of cubic segments (each continuing the
+// previous one), splitting them (de Casteljau) or evaluating them, uniformly at each level and
+// adaptively; the line counts of both methods are checked to agree
+// usage: bezier_bench [strands] (default 100000 strands of 4 segments)
+
+// number of failed checks
+int _failures = 0;
+
+// report a failed check
+void _check(bool ok, const char* what, int level) {
+    if(ok) return;
+    printf("FAILED: %s (level %d)\n", what, level);
+    _failures++;
+}
+
+// strands of cubic segments with random control points, each segment starting at the end of the previous one
+Mesh* _make_strands(int strands, int segments, int level, float tolerance) {
+    auto rng = std::mt19937(7);
+    auto dist = std::uniform_real_distribution<float>(-1,1);
+    auto mesh = new Mesh();
+    mesh->subdivision_bezier_level = level;
+    mesh->subdivision_bezier_tolerance = tolerance;
+    for(auto s = 0; s < strands; s++) {
+        auto p = vec3f(dist(rng),dist(rng),dist(rng)) * 10;
+        mesh->pos.push_back(p);
+        for(auto k = 0; k < segments; k++) {
+            auto start = (int)mesh->pos.size()-1;
+            for(auto i = 0; i < 3; i++) {
+                p += vec3f(dist(rng),dist(rng)+1,dist(rng)) * 0.3f;
+                mesh->pos.push_back(p);
+            }
+            mesh->spline.push_back({start,start+1,start+2,start+3});
+        }
+    }
+    return mesh;
+}
+
+// tessellates copies of mesh, returning the best time in milliseconds and the result of the last run
+double _run(Mesh* mesh, bool evaluate, Mesh& result) {
+    auto best = 1e30;
+    for(auto k = 0; k < 3; k++) {
+        result = *mesh;
+        auto start = std::chrono::high_resolution_clock::now();
+        subdivide_bezier(&result, nullptr, 0, 0, evaluate);
+        auto elapsed = std::chrono::duration<double,std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        best = std::min(best, elapsed);
+    }
+    return best;
+}
+
+// runs both methods on the strands and prints their times and throughput
+void _bench(const char* what, int strands, int segments, int level, float tolerance) {
+    auto mesh = _make_strands(strands, segments, level, tolerance);
+    auto split = Mesh(), evaluated = Mesh();
+    auto ts = _run(mesh, false, split);
+    auto te = _run(mesh, true, evaluated);
+    printf("%-9s level %d: split %8.2f ms (%6.1f M lines/s, %8d lines)  evaluate %8.2f ms (%6.1f M lines/s, %8d lines)\n",
+           what, level, ts, split.line.size() / (ts * 1000), (int)split.line.size(),
+           te, evaluated.line.size() / (te * 1000), (int)evaluated.line.size());
+    // uniform tessellation makes 3*2^level lines per segment with both methods, and evaluation
+    // writes one tangent per vertex; both keep the strand end points
+    if(tolerance <= 0) {
+        _check((int)split.line.size() == strands*segments*(3 << level), "split line count", level);
+        _check(evaluated.line.size() == split.line.size(), "evaluated line count", level);
+    }
+    _check(evaluated.norm.size() == evaluated.pos.size() and split.norm.size() == split.pos.size(), "tangent count", level);
+    _check(split.pos.front() == mesh->pos.front() and split.pos.back() == mesh->pos.back(), "split end points", level);
+    _check(evaluated.pos.front() == mesh->pos.front() and evaluated.pos.back() == mesh->pos.back(), "evaluated end points", level);
+    delete mesh;
+}
+
+int main(int argc, char** argv) {
+    auto strands = (argc > 1) ? atoi(argv[1]) : 100000;
+    const int segments = 4;
+    printf("%d strands of %d segments\n", strands, segments);
+    for(auto level : range(1,5)) _bench("uniform", strands, segments, level, 0);
+    for(auto level : range(1,5)) _bench("adaptive", strands, segments, level, 0.01f);
+    if(_failures) { printf("%d checks failed\n", _failures); return 1; }
+    return 0;
+}
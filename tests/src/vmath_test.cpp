@@ -0,0 +1,258 @@
+#include "../../src/common.h"
+#include "../../src/vmath.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+
+// Tests of the packet math in vmath.h
+// each batched kernel is compared bit by bit against the scalar operations it replaces,
+// at all tail counts; with "bench" as argument the kernels are also timed against the scalar loops
+
+// number of failed checks
+int _failures = 0;
+
+// report a failed check
+void _check(bool ok, const char* what, int count, int i) {
+    if(ok) return;
+    if(_failures < 20) printf("FAILED: %s (count %d, element %d)\n", what, count, i);
+    _failures++;
+}
+
+// bitwise equality (so that NaNs and signed zeros compare too)
+bool _same(float a, float b) { return memcmp(&a, &b, sizeof(float)) == 0; }
+bool _same(const vec3f& a, const vec3f& b) { return _same(a.x,b.x) and _same(a.y,b.y) and _same(a.z,b.z); }
+
+// random vectors in [-r,r]^3, with some zero vectors mixed in
+vector<vec3f> _random_vectors(std::mt19937& rng, int count, float r = 10) {
+    auto dist = std::uniform_real_distribution<float>(-r,r);
+    auto v = vector<vec3f>(count);
+    for(auto& p : v) p = (rng() % 8 == 0) ? zero3f : vec3f(dist(rng),dist(rng),dist(rng));
+    return v;
+}
+
+// random frame (orthonormal axes) and projective matrix
+frame3f _random_frame(std::mt19937& rng) {
+    auto v = _random_vectors(rng, 3);
+    return lookat_frame(v[0], v[0] + v[1] + vec3f(0,0,1), vec3f(0,1,0));
+}
+mat4f _random_matrix() {
+    return frustum_matrix(-0.5f, 0.5f, -0.5f, 0.5f, 0.1f, 100.0f) * translation_matrix(vec3f(0.5f,-1,-20));
+}
+
+// sentinel written after the outputs, to catch kernels writing past count
+const float _guard = 12345.0f;
+
+// checks a batched kernel on all counts from 0 to 11 and one large count with a tail of three,
+// writing to separate outputs and in place
+template<typename S, typename B>
+void _check_kernel(const char* what, std::mt19937& rng, const S& scalar, const B& batched) {
+    for(auto count : {0,1,2,3,4,5,6,7,8,9,10,11,4099}) {
+        auto a = _random_vectors(rng, count), b = _random_vectors(rng, count);
+        auto out = vector<vec3f>(count+4, vec3f(_guard,_guard,_guard));
+        batched(a.data(), b.data(), out.data(), count);
+        for(auto i = 0; i < count; i++) _check(_same(out[i], scalar(a[i], b[i])), what, count, i);
+        for(auto i = count; i < count+4; i++) _check(_same(out[i], vec3f(_guard,_guard,_guard)), what, count, i);
+        // in place (out aliases the first input)
+        auto c = a;
+        batched(c.data(), b.data(), c.data(), count);
+        for(auto i = 0; i < count; i++) _check(_same(c[i], scalar(a[i], b[i])), what, count, i);
+    }
+}
+
+// float4 operations against the scalar ones, lane by lane
+void _test_float4(std::mt19937& rng) {
+    auto dist = std::uniform_real_distribution<float>(-10,10);
+    for(auto k = 0; k < 1000; k++) {
+        float a[4], b[4], c[4], r[4];
+        for(auto i = 0; i < 4; i++) { a[i] = dist(rng); b[i] = (k % 4 == i) ? a[i] : dist(rng); c[i] = dist(rng); }
+        auto pa = load4(a), pb = load4(b), pc = load4(c);
+        // loads and stores round trip
+        store4(r, pa); for(auto i = 0; i < 4; i++) _check(_same(r[i], a[i]), "float4 load4/store4", 4, i);
+        store4(r, splat4(a[0])); for(auto i = 0; i < 4; i++) _check(_same(r[i], a[0]), "float4 splat4", 4, i);
+        store4(r, pa+pb); for(auto i = 0; i < 4; i++) _check(_same(r[i], a[i]+b[i]), "float4 +", 4, i);
+        store4(r, pa-pb); for(auto i = 0; i < 4; i++) _check(_same(r[i], a[i]-b[i]), "float4 -", 4, i);
+        store4(r, pa*pb); for(auto i = 0; i < 4; i++) _check(_same(r[i], a[i]*b[i]), "float4 *", 4, i);
+        store4(r, pa/pb); for(auto i = 0; i < 4; i++) _check(_same(r[i], a[i]/b[i]), "float4 /", 4, i);
+        store4(r, min(pa,pb)); for(auto i = 0; i < 4; i++) _check(_same(r[i], min(a[i],b[i])), "float4 min", 4, i);
+        store4(r, max(pa,pb)); for(auto i = 0; i < 4; i++) _check(_same(r[i], max(a[i],b[i])), "float4 max", 4, i);
+        store4(r, sqrt(pa*pa)); for(auto i = 0; i < 4; i++) _check(_same(r[i], sqrt(a[i]*a[i])), "float4 sqrt", 4, i);
+        store4(r, madd(pa,pb,pc)); for(auto i = 0; i < 4; i++) _check(_same(r[i], a[i]*b[i]+c[i]), "float4 madd", 4, i);
+        // comparisons through select, and masks combined with mask_and
+        store4(r, select(cmpge(pa,pb), pa, pc)); for(auto i = 0; i < 4; i++) _check(_same(r[i], (a[i] >= b[i]) ? a[i] : c[i]), "float4 cmpge/select", 4, i);
+        store4(r, select(cmple(pa,pb), pa, pc)); for(auto i = 0; i < 4; i++) _check(_same(r[i], (a[i] <= b[i]) ? a[i] : c[i]), "float4 cmple/select", 4, i);
+        store4(r, select(cmpeq(pa,pb), pa, pc)); for(auto i = 0; i < 4; i++) _check(_same(r[i], (a[i] == b[i]) ? a[i] : c[i]), "float4 cmpeq/select", 4, i);
+        store4(r, select(mask_and(cmpge(pa,pb),cmple(pa,pc)), pa, pb)); for(auto i = 0; i < 4; i++) _check(_same(r[i], (a[i] >= b[i] and a[i] <= c[i]) ? a[i] : b[i]), "float4 mask_and", 4, i);
+    }
+}
+
+// vec3f4 loads and stores and operations against the vec3f ones
+void _test_vec3f4(std::mt19937& rng) {
+    // loads and stores at every offset, leaving the neighbours untouched
+    auto v = _random_vectors(rng, 16);
+    for(auto offset = 0; offset+4 <= 16; offset++) {
+        auto out = vector<vec3f>(16, vec3f(_guard,_guard,_guard));
+        store4(out.data()+offset, load4(v.data()+offset));
+        for(auto i = 0; i < 16; i++) _check(_same(out[i], (i >= offset and i < offset+4) ? v[i] : vec3f(_guard,_guard,_guard)), "vec3f4 load4/store4", offset, i);
+    }
+    for(auto k = 0; k < 1000; k++) {
+        auto a = _random_vectors(rng, 4), b = _random_vectors(rng, 4);
+        auto pa = load4(a.data()), pb = load4(b.data());
+        vec3f r[4]; float d[4];
+        store4(r, pa+pb); for(auto i = 0; i < 4; i++) _check(_same(r[i], a[i]+b[i]), "vec3f4 +", 4, i);
+        store4(r, pa-pb); for(auto i = 0; i < 4; i++) _check(_same(r[i], a[i]-b[i]), "vec3f4 -", 4, i);
+        store4(r, cross(pa,pb)); for(auto i = 0; i < 4; i++) _check(_same(r[i], cross(a[i],b[i])), "vec3f4 cross", 4, i);
+        store4(r, normalize(pa)); for(auto i = 0; i < 4; i++) _check(_same(r[i], normalize(a[i])), "vec3f4 normalize", 4, i);
+        store4(d, dot(pa,pb)); for(auto i = 0; i < 4; i++) _check(_same(d[i], dot(a[i],b[i])), "vec3f4 dot", 4, i);
+        store4(d, length(pa)); for(auto i = 0; i < 4; i++) _check(_same(d[i], length(a[i])), "vec3f4 length", 4, i);
+    }
+    // zero vectors normalize to zero, in every lane and mixed with non-zero ones
+    for(auto mask = 0; mask < 16; mask++) {
+        auto a = vector<vec3f>(4);
+        for(auto i = 0; i < 4; i++) a[i] = (mask & (1 << i)) ? zero3f : vec3f(i+1.0f,-2,0.5f);
+        vec3f r[4];
+        store4(r, normalize(load4(a.data())));
+        for(auto i = 0; i < 4; i++) _check(_same(r[i], normalize(a[i])) and (not (mask & (1 << i)) or _same(r[i], zero3f)), "vec3f4 normalize of zero", mask, i);
+    }
+}
+
+// vec3f_soa padding, conversions and packet access
+void _test_soa(std::mt19937& rng) {
+    for(auto count : {0,1,2,3,4,5,6,7,8,9,4099}) {
+        auto v = _random_vectors(rng, count);
+        auto soa = to_soa(v);
+        _check(soa.size() == count and soa.x.size() % 4 == 0 and soa.x.size() < (size_t)count+4, "vec3f_soa size", count, 0);
+        _check(((size_t)soa.x.data() % 16) == 0 and ((size_t)soa.y.data() % 16) == 0 and ((size_t)soa.z.data() % 16) == 0, "vec3f_soa alignment", count, 0);
+        for(auto i = count; i < (int)soa.x.size(); i++) _check(_same(soa.at(i), v[count-1]), "vec3f_soa padding", count, i);
+        auto back = to_aos(soa);
+        _check(back.size() == v.size(), "to_aos size", count, 0);
+        for(auto i = 0; i < count; i++) _check(_same(back[i], v[i]), "to_soa/to_aos", count, i);
+        // packet loads and stores of whole packets, including the padding
+        auto copy = vec3f_soa(count);
+        for(auto i = 0; i < (int)soa.x.size(); i += 4) store4(copy, i, load4(soa, i));
+        for(auto i = 0; i < (int)soa.x.size(); i++) _check(_same(copy.at(i), soa.at(i)), "vec3f_soa load4/store4", count, i);
+        if(count) {
+            vec3f g[4];
+            store4(g, gather4(soa, count-1, 0, count/2, count-1));
+            int idx[4] = {count-1, 0, count/2, count-1};
+            for(auto i = 0; i < 4; i++) _check(_same(g[i], v[idx[i]]), "vec3f_soa gather4", count, i);
+        }
+        // normalize in place
+        auto n = soa;
+        normalize_array(n);
+        for(auto i = 0; i < count; i++) _check(_same(n.at(i), normalize(v[i])), "normalize_array (soa)", count, i);
+        // displace along directions
+        auto dir = _random_vectors(rng, count);
+        auto amount = vector<float>(count);
+        for(auto i = 0; i < count; i++) amount[i] = (float)i / 7 - 3;
+        auto moved = soa;
+        displace_array(moved, to_soa(dir), amount);
+        for(auto i = 0; i < count; i++) _check(_same(moved.at(i), v[i] + dir[i] * amount[i]), "displace_array (soa)", count, i);
+        for(auto i = count; i < (int)moved.x.size(); i++) _check(_same(moved.at(i), moved.at(count-1)), "displace_array padding", count, i);
+        // bounds of both layouts
+        auto bbox = range3f();
+        for(auto& p : v) bbox = runion(bbox, p);
+        auto ba = bounds(v), bs = bounds(soa);
+        _check(_same(ba.min,bbox.min) and _same(ba.max,bbox.max), "bounds", count, 0);
+        _check(count == 0 or (_same(bs.min,bbox.min) and _same(bs.max,bbox.max)), "bounds (soa)", count, 0);
+    }
+}
+
+// batched kernels over arrays of vectors against the scalar loops
+void _test_kernels(std::mt19937& rng) {
+    auto f = _random_frame(rng);
+    auto m = _random_matrix();
+    _check_kernel("transform_point_array (frame)", rng,
+                  [&](const vec3f& a, const vec3f&) { return transform_point(f, a); },
+                  [&](const vec3f* a, const vec3f*, vec3f* out, int count) { transform_point_array(f, a, out, count); });
+    _check_kernel("transform_point_array (matrix)", rng,
+                  [&](const vec3f& a, const vec3f&) { return transform_point(m, a); },
+                  [&](const vec3f* a, const vec3f*, vec3f* out, int count) { transform_point_array(m, a, out, count); });
+    _check_kernel("transform_vector_array", rng,
+                  [&](const vec3f& a, const vec3f&) { return transform_vector(f, a); },
+                  [&](const vec3f* a, const vec3f*, vec3f* out, int count) { transform_vector_array(f, a, out, count); });
+    _check_kernel("normalize_array", rng,
+                  [&](const vec3f& a, const vec3f&) { return normalize(a); },
+                  [&](const vec3f* a, const vec3f*, vec3f* out, int count) { normalize_array(a, out, count); });
+    _check_kernel("cross_array", rng,
+                  [&](const vec3f& a, const vec3f& b) { return cross(a, b); },
+                  [&](const vec3f* a, const vec3f* b, vec3f* out, int count) { cross_array(a, b, out, count); });
+    // dot products write floats, so they are checked here
+    for(auto count : {0,1,2,3,4,5,6,7,8,9,10,11,4099}) {
+        auto a = _random_vectors(rng, count), b = _random_vectors(rng, count);
+        auto out = vector<float>(count+4, _guard);
+        dot_array(a.data(), b.data(), out.data(), count);
+        for(auto i = 0; i < count; i++) _check(_same(out[i], dot(a[i], b[i])), "dot_array", count, i);
+        for(auto i = count; i < count+4; i++) _check(_same(out[i], _guard), "dot_array", count, i);
+    }
+}
+
+// time in seconds of running f the given number of times (best of three)
+template<typename F>
+double _time(int runs, const F& f) {
+    auto best = 1e30;
+    for(auto k = 0; k < 3; k++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        for(auto r = 0; r < runs; r++) f();
+        auto elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        best = std::min(best, elapsed);
+    }
+    return best;
+}
+
+// keeps the benchmarks from being optimized away
+volatile float _sink = 0;
+
+// prints the time per vector of the scalar loop and of the batched kernel
+template<typename S, typename B>
+void _bench(const char* what, int count, int runs, vector<vec3f>& out, const S& scalar, const B& batched) {
+    auto ts = _time(runs, [&]() { scalar(); _sink = _sink + out[count/2].x; });
+    auto tb = _time(runs, [&]() { batched(); _sink = _sink + out[count/2].x; });
+    printf("%-32s scalar %6.2f ns  batched %6.2f ns  speedup %.2fx\n", what, ts*1e9/(runs*(double)count), tb*1e9/(runs*(double)count), ts/tb);
+}
+
+// microbenchmarks of the batched kernels against the scalar loops, on arrays that fit in cache
+void _bench_kernels(std::mt19937& rng) {
+    const int count = 4099, runs = 20000;
+    auto a = _random_vectors(rng, count), b = _random_vectors(rng, count);
+    auto out = vector<vec3f>(count);
+    auto d = vector<float>(count);
+    auto f = _random_frame(rng);
+    auto m = _random_matrix();
+    printf("%d vectors, packets %s\n", count, (vmath_packets) ? "on" : "off");
+    _bench("transform_point_array (frame)", count, runs, out,
+           [&]() { for(auto i = 0; i < count; i++) out[i] = transform_point(f, a[i]); },
+           [&]() { transform_point_array(f, a.data(), out.data(), count); });
+    _bench("transform_point_array (matrix)", count, runs, out,
+           [&]() { for(auto i = 0; i < count; i++) out[i] = transform_point(m, a[i]); },
+           [&]() { transform_point_array(m, a.data(), out.data(), count); });
+    _bench("transform_vector_array", count, runs, out,
+           [&]() { for(auto i = 0; i < count; i++) out[i] = transform_vector(f, a[i]); },
+           [&]() { transform_vector_array(f, a.data(), out.data(), count); });
+    _bench("normalize_array", count, runs, out,
+           [&]() { for(auto i = 0; i < count; i++) out[i] = normalize(a[i]); },
+           [&]() { normalize_array(a.data(), out.data(), count); });
+    _bench("cross_array", count, runs, out,
+           [&]() { for(auto i = 0; i < count; i++) out[i] = cross(a[i], b[i]); },
+           [&]() { cross_array(a.data(), b.data(), out.data(), count); });
+    _bench("dot_array", count, runs, out,
+           [&]() { for(auto i = 0; i < count; i++) d[i] = dot(a[i], b[i]); out[count/2].x = d[count/2]; },
+           [&]() { dot_array(a.data(), b.data(), d.data(), count); out[count/2].x = d[count/2]; });
+    _bench("bounds", count, runs, out,
+           [&]() { auto bbox = range3f(); for(auto i = 0; i < count; i++) bbox = runion(bbox, a[i]); out[count/2] = bbox.max; },
+           [&]() { out[count/2] = bounds(a).max; });
+}
+
+int main(int argc, char** argv) {
+    auto rng = std::mt19937(7);
+    _test_float4(rng);
+    _test_vec3f4(rng);
+    _test_soa(rng);
+    _test_kernels(rng);
+    if(_failures) { printf("%d checks failed\n", _failures); return 1; }
+    printf("all checks passed (packets %s)\n", (vmath_packets) ? "on" : "off");
+    if(argc > 1 and std::string(argv[1]) == "bench") _bench_kernels(rng);
+    return 0;
+}